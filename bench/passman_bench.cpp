@@ -0,0 +1,163 @@
+#include <botan/auto_rng.h>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSqlQuery>
+#include <QTemporaryDir>
+
+#include "pdpp_database.hpp"
+#include "pdpp_entry.hpp"
+
+/*
+ * passman_bench: times each stage of the open/save pipeline on synthetic vaults.
+ *
+ * Usage: passman_bench [entries...]
+ * Defaults to vaults of 10, 1000, 10000 and 100000 entries. Results are printed to stdout as JSON.
+ * The legacy* stages time the version 7 SQL path, which version 8 saves no longer use, on the statements generated by saveSt.
+ */
+
+using namespace passman;
+
+namespace {
+    const QString benchPassword = "correct horse battery staple";
+
+    // Time a single call and return the elapsed time in milliseconds.
+    template <typename Func>
+    double timed(Func &&f) {
+        QElapsedTimer timer;
+        timer.start();
+        f();
+        return static_cast<double>(timer.nsecsElapsed()) / 1e6;
+    }
+
+    void dropTables() {
+        for (const QString &tbl : db.tables()) {
+            db.exec("DROP TABLE \"" + tbl + '"');
+        }
+    }
+
+    PDPPEntry *makeEntry(PDPPDatabase *t_database, const int t_index) {
+        const QString id = QString::number(t_index);
+
+        QList<Field *> fields = {
+            t_database->makeField("Name", "entry-" + id, QMetaType::QString),
+            t_database->makeField("Email", "user" + id + "@example.com", QMetaType::QString),
+            t_database->makeField("URL", "https://service" + id + ".example.com/login", QMetaType::QString),
+            t_database->makeField("Notes", "Synthetic entry " + id + "\nSecond line of notes.", QMetaType::QByteArray),
+            t_database->makeField("Password", "pw-" + id + "-Xk2!q9", QMetaType::QString),
+            t_database->makeField("OTP", "", QMetaType::QString)
+        };
+
+        return t_database->makeEntry(fields);
+    }
+
+    QJsonObject runSize(const QString &t_dir, const int t_entries) {
+        QJsonObject stages;
+        const QString path = t_dir + "/bench-" + QString::number(t_entries) + ".pdpp";
+
+        dropTables();
+
+        // Save pipeline.
+        PDPPDatabase out;
+        out.path = path;
+
+        // The IV doubles as the KDF's seed, so it has to be in place before deriving the key.
+        Botan::AutoSeeded_RNG rng;
+        out.ivLen = KDF::nonceLength(out.encryption);
+        out.iv = rng.random_vec(out.ivLen);
+        out.passw = out.makeKdf()->transform(benchPassword);
+
+        for (const int i : range(0, t_entries)) {
+            out.addEntry(makeEntry(&out, i));
+        }
+
+        stages.insert("encryptedData", timed([&out] { out.data = out.encryptedData(); }));
+        stages.insert("write", timed([&out] { out.write(); }));
+
+        dropTables();
+
+        // Open pipeline.
+        PDPPDatabase in;
+        in.path = path;
+
+        VectorUnion key;
+
+        stages.insert("parse", timed([&in] { in.parse(); }));
+        stages.insert("kdfTransform", timed([&in, &key] { key = in.makeKdf()->transform(benchPassword); }));
+        stages.insert("decryptData", timed([&in, &key] { in.decryptData(key); }));
+        stages.insert("loadEntries", timed([&in] { in.loadEntries(in.stList); }));
+
+        const qsizetype loaded = in.entryLength();
+
+        // Legacy (version 7) SQL path, replaying the statements saveSt() generates.
+        dropTables();
+        stages.insert("legacySaveSt", timed([&out] { out.saveSt(); }));
+        dropTables();
+
+        PDPPDatabase legacy;
+        legacy.path = path;
+        legacy.stList = out.stList;
+
+        stages.insert("legacyReplay", timed([&legacy] { legacy.replay(); }));
+        stages.insert("legacyGet", timed([&legacy] { legacy.get(); }));
+        stages.insert("legacyLoadFields", timed([&legacy] {
+            for (PDPPEntry *e : legacy.entries()) {
+                e->ensureLoaded();
+            }
+        }));
+
+        QJsonObject result;
+        result.insert("entries", t_entries);
+        result.insert("loadedEntries", static_cast<qint64>(loaded));
+        result.insert("fileBytes", QFileInfo(path).size());
+        result.insert("stagesMs", stages);
+
+        return result;
+    }
+}
+
+int main(int argc, char **argv) {
+    QCoreApplication app(argc, argv);
+
+    QList<int> sizes;
+    for (const QString &arg : QCoreApplication::arguments().mid(1)) {
+        bool ok;
+        const int n = arg.toInt(&ok);
+        if (!ok || n <= 0) {
+            std::cerr << "Invalid entry count: " << arg.toStdString() << std::endl;
+            return 1;
+        }
+        sizes.emplaceBack(n);
+    }
+
+    if (sizes.isEmpty()) {
+        sizes = {10, 1000, 10000, 100000};
+    }
+
+    QTemporaryDir dir;
+    if (!dir.isValid()) {
+        std::cerr << "Unable to create a temporary directory." << std::endl;
+        return 1;
+    }
+
+    db.setDatabaseName(":memory:");
+    if (!db.open()) {
+        std::cerr << "Unable to open the SQL database." << std::endl;
+        return 1;
+    }
+
+    QJsonArray results;
+    for (const int n : sizes) {
+        results.append(runSize(dir.path(), n));
+    }
+
+    QJsonObject report;
+    report.insert("libpassman", QString::fromStdString(Constants::libpassmanVersion));
+    report.insert("results", results);
+
+    std::cout << QJsonDocument(report).toJson().constData();
+    return 0;
+}
@@ -0,0 +1,69 @@
+#ifndef ARENA_H
+#define ARENA_H
+#include <QMutex>
+
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace passman {
+    /**
+     * Owns objects laid out one after another in large chunks of secure memory, and frees them all at once.
+     *
+     * Objects are constructed in place by make() and never freed one by one. release() (or the destructor) runs every object's destructor,
+     * then wipes and frees the chunks, so a whole vault's entries and fields go in a handful of deallocations. Safe to use from several threads.
+     */
+    class Arena
+    {
+        struct Chunk {
+            uint8_t *data;
+            size_t size;
+        };
+
+        std::vector<Chunk> m_chunks;
+        size_t m_used = 0;
+        std::vector<std::pair<void *, void (*)(void *)>> m_objects;
+        mutable QMutex m_mutex;
+
+        void *allocate(const size_t t_size, const size_t t_align);
+        void adopt(void *t_object, void (*t_destroy)(void *));
+    public:
+        Arena() = default;
+        /** Releases everything in the arena. */
+        ~Arena();
+
+        Arena(const Arena &) = delete;
+        Arena &operator=(const Arena &) = delete;
+
+        /**
+         * Construct an object in the arena. It lives until the arena is released, and must not be deleted.
+         */
+        template <typename T, typename... Args>
+        T *make(Args &&...t_args) {
+            // Constructed outside the lock, since constructors may make more objects (a new entry makes its default fields).
+            T *object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(t_args)...);
+            adopt(object, [](void *t_ptr) {
+                static_cast<T *>(t_ptr)->~T();
+            });
+
+            return object;
+        }
+
+        /**
+         * Returns how many objects the arena holds.
+         */
+        size_t objectCount() const;
+
+        /**
+         * Returns how many bytes of chunks the arena has allocated.
+         */
+        size_t bytes() const;
+
+        /**
+         * Destroy every object in the arena, newest first, then wipe and free its chunks. The arena can be used again afterwards.
+         */
+        void release();
+    };
+}
+
+#endif // ARENA_H
@@ -0,0 +1,81 @@
+#ifndef ATOMTABLE_H
+#define ATOMTABLE_H
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+
+#include <deque>
+
+namespace passman {
+    class AtomTable;
+
+    /** An interned field name. Atoms never move or change, so fields can keep pointers to them. */
+    struct Atom {
+        /** Index in its table. The case-folded known names (see AtomTable::Known) have the same id in every table. */
+        uint32_t id;
+        QString name;
+        /** The name as UTF-8, as it is stored in version 8 records. */
+        QByteArray utf8;
+        /** The atom of the case-folded name; the atom itself if its name is already folded. */
+        const Atom *folded;
+        AtomTable *table;
+    };
+
+    /**
+     * Interns field names, so the thousands of fields sharing a handful of names share one copy of each.
+     * Every PDPPDatabase has one for the fields it makes; fields created on their own use AtomTable::shared(). Safe to use from several threads.
+     */
+    class AtomTable
+    {
+        std::deque<Atom> m_atoms;
+        QHash<QString, const Atom *> m_index;
+        QHash<QByteArray, const Atom *> m_utf8Index;
+        mutable QMutex m_mutex;
+
+        const Atom *add(const QString &t_name, const QByteArray &t_utf8);
+    public:
+        /** Folded names interned up front, in this order, by every table. */
+        enum Known : uint32_t {
+            Empty = 0,
+            Name,
+            Email,
+            Url,
+            Notes,
+            Password,
+            Otp,
+            KnownCount
+        };
+
+        AtomTable();
+        AtomTable(const AtomTable &) = delete;
+        AtomTable &operator=(const AtomTable &) = delete;
+
+        /**
+         * Get the atom for a name, adding it if it's new.
+         */
+        const Atom *intern(const QString &t_name);
+
+        /**
+         * Get the atom for a UTF-8 name. Names already in the table are found without decoding or allocating.
+         */
+        const Atom *intern(const char *t_utf8, const qsizetype t_length);
+
+        /**
+         * Returns how many names are interned.
+         */
+        qsizetype size() const;
+
+        /**
+         * Forget every name but the known ones. Atoms handed out before are invalid afterwards, so nothing may still refer to them.
+         */
+        void clear();
+
+        /**
+         * The process-wide table used by fields created outside of a database. Its names are never freed.
+         */
+        static AtomTable &shared();
+    };
+}
+
+#endif // ATOMTABLE_H
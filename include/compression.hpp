@@ -0,0 +1,28 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+#include <botan/compression.h>
+
+#include "constants.hpp"
+
+namespace passman {
+    /**
+     * Returns true if a compression option can be used by this build. Option 0 (none) always can; gzip, bzip2 and lzma depend on
+     * the modules Botan was built with, and zstd on libpassman being built against libzstd.
+     */
+    bool compressionAvailable(const uint8_t t_compression);
+
+    /**
+     * Make a compressor for a compression option (see Constants::compressionMatch).
+     * Start it with the database's compression level; 0 uses the algorithm's default level.
+     *
+     * @return The compressor, or nullptr for option 0. Throws an std::runtime_error for invalid options and ones this build doesn't support.
+     */
+    std::unique_ptr<Botan::Compression_Algorithm> makeCompressor(const uint8_t t_compression);
+
+    /**
+     * Make a decompressor for a compression option, like makeCompressor().
+     */
+    std::unique_ptr<Botan::Decompression_Algorithm> makeDecompressor(const uint8_t t_compression);
+}
+
+#endif // COMPRESSION_H
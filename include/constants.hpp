@@ -8,10 +8,12 @@
 /* Constants for libpassman. */
 namespace passman {
     namespace Constants {
-        constexpr int maxVersion {7};
+        constexpr int maxVersion {8};
+        constexpr size_t streamChunkSize {65536};
         const QList<std::string> hmacMatch {"Blake2b", "SHA-3", "SHAKE-256", "Skein-512", "SHA-512"};
         const QList<std::string> hashMatch {"Argon2id", "Bcrypt-PBKDF", "Scrypt", "No hashing, only derivation"};
-        const QList<std::string> encryptionMatch {"AES-256/GCM", "Twofish/GCM", "SHACAL2/EAX", "Serpent/GCM"};
+        const QList<std::string> compressionMatch {"None", "gzip", "bzip2", "lzma", "zstd"};
+        const QList<std::string> encryptionMatch {"AES-256/GCM", "Twofish/GCM", "SHACAL2/EAX", "Serpent/GCM", "ChaCha20Poly1305"};
 
         const std::string libpassmanVersion {"2.1.1"};
 
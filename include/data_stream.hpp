@@ -1,26 +1,49 @@
 #ifndef DATASTREAM_H
 #define DATASTREAM_H
+#include <QSaveFile>
+
 #include "extra.hpp"
 #include "vector_union.hpp"
 
 namespace passman {
-    /* Utility class for writing a couple extra types to an std::ofstream.
-     * Prefer over direct operator overloads when overloading already-existing overloads. */
+    /* Utility class for writing a couple extra types to a file.
+     * Prefer over direct operator overloads when overloading already-existing overloads.
+     * Multi-byte integers are written big-endian, matching QDataStream.
+     *
+     * Output is buffered and goes to a temporary file, which finish() syncs to disk and renames over the target.
+     * Until then the target is untouched, so a failed or interrupted save never leaves a half-written file behind.
+     * Throws an std::runtime_error if the file can't be opened, written or committed. */
     class DataStream
     {
     public:
-        DataStream(const std::string &path, const std::fstream::openmode mode);
+        explicit DataStream(const QString &path);
 
         DataStream &operator<<(const uint8_t val);
         DataStream &operator<<(const uint16_t val);
+        DataStream &operator<<(const uint32_t val);
         DataStream &operator<<(const int val);
         DataStream &operator<<(const bool val);
         DataStream &operator<<(const char *val);
-        DataStream &operator<<(const VectorUnion val);
+        DataStream &operator<<(const VectorUnion &val);
+
+        /** Write t_len raw bytes in one go. Large writes skip the buffer. */
+        DataStream &write(const uint8_t *t_data, const size_t t_len);
+
+        /** The amount of bytes written so far. */
+        qint64 pos() const;
 
         void finish();
 
-        std::ofstream stream;
+    private:
+        static constexpr qsizetype bufferSize = 65536;
+
+        void put(const char c);
+        void flush();
+        void writeRaw(const char *t_data, const qint64 t_len);
+
+        QSaveFile m_file;
+        QByteArray m_buffer;
+        qint64 m_pos = 0;
     };
 }
 
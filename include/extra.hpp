@@ -5,6 +5,7 @@
 #include <sstream>
 #include <iostream>
 #include <fstream>
+#include <stdexcept>
 #include <botan/secmem.h>
 
 #include <QSqlDatabase>
@@ -21,6 +22,53 @@ namespace passman {
     };
     Q_DECLARE_FLAGS(PasswordOptionsFlag, PasswordOptions)
 
+    /*
+     * How a version 8 database's encrypted data is laid out.
+     */
+    enum DataLayout : uint8_t {
+        SinglePayload = 0,
+        EntryBlocks = 1,
+        Stream = 2
+    };
+
+    /*
+     * A non-owning view of contiguous bytes, such as part of a memory-mapped file.
+     * The bytes must outlive the view.
+     */
+    struct ByteView {
+        const uint8_t *ptr = nullptr;
+        size_t len = 0;
+
+        inline const uint8_t *data() const {
+            return ptr;
+        }
+
+        inline size_t size() const {
+            return len;
+        }
+
+        inline bool empty() const {
+            return len == 0;
+        }
+
+        inline uint8_t operator[](const size_t i) const {
+            return ptr[i];
+        }
+
+        inline const uint8_t *begin() const {
+            return ptr;
+        }
+
+        inline const uint8_t *end() const {
+            return ptr + len;
+        }
+
+        /* The bytes from t_pos onwards. */
+        inline ByteView mid(const size_t t_pos) const {
+            return {ptr + t_pos, len - t_pos};
+        }
+    };
+
     /*
      * Qt's tr() function, for internal use within the passman namespace.
      */
@@ -36,6 +84,35 @@ namespace passman {
      */
     const QString tr(const char *s);
 
+    /*
+     * Append an unsigned integer to a byte vector, little-endian.
+     */
+    template <typename IntType>
+    void appendInt(secvec &t_out, const IntType t_val) {
+        for (size_t i = 0; i < sizeof(IntType); ++i) {
+            t_out.push_back(static_cast<uint8_t>(t_val >> (8 * i)));
+        }
+    }
+
+    /*
+     * Read a little-endian unsigned integer from a byte vector (or ByteView) at t_pos, advancing t_pos past it.
+     * Throws an std::runtime_error if the vector is too short.
+     */
+    template <typename IntType, typename Bytes>
+    IntType readInt(const Bytes &t_in, size_t &t_pos) {
+        if (t_pos > t_in.size() || t_in.size() - t_pos < sizeof(IntType)) {
+            throw std::runtime_error("Unexpected end of entry data.");
+        }
+
+        IntType val = 0;
+        for (size_t i = 0; i < sizeof(IntType); ++i) {
+            val = static_cast<IntType>(val | static_cast<IntType>(t_in[t_pos + i]) << (8 * i));
+        }
+
+        t_pos += sizeof(IntType);
+        return val;
+    }
+
     /*
      * Generate a range list of an integer type.
      */
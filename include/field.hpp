@@ -1,32 +1,67 @@
 #ifndef FIELD_H
 #define FIELD_H
 #include "vector_union.hpp"
+#include "atom_table.hpp"
 
 namespace passman {
+    class PDPPEntry;
+    class PDPPDatabase;
+
     /** Class that wraps around an entry data field. */
     class Field
     {
-        QString m_name;
+        /** Interned name, shared by every field with the same name in the same table. Its folded atom makes comparisons integer compares. */
+        const Atom *m_name;
         VectorUnion m_data;
         QMetaType::Type m_type;
+        PDPPEntry *m_entry = nullptr;
+        bool m_null = false;
+
+        void changed();
     public:
         /**
          *  @param t_name Name of the field.
          *  @param t_data Data to be stored in the field.
          *  @param t_type QMetaType indicating what type the data is. String for strings, Double for numbers, Bool for bools, and QByteArray for multi-line text.
+         *
+         *  The name is interned in AtomTable::shared(). Fields made by a database (PDPPDatabase::makeField) use its own table instead.
          */
         Field(const QString &t_name, const VectorUnion &t_data, const QMetaType::Type t_type)
+            : Field(AtomTable::shared().intern(t_name), t_data, t_type) {}
+
+        /**
+         *  @param t_name Atom of the field's name. Renames are interned in the same table.
+         */
+        Field(const Atom *t_name, const VectorUnion &t_data, const QMetaType::Type t_type)
             : m_name(t_name)
             , m_data(t_data)
             , m_type(t_type) {}
 
+        /**
+         * The field PDPPEntry::fieldNamed returns when no field matches: a nameless, empty string field that ignores every change.
+         * It is shared, so never delete it or add it to an entry.
+         */
+        static Field *notFound();
+
+        /**
+         * Returns true if this is the Field::notFound sentinel.
+         */
+        inline bool isNull() const {
+            return this->m_null;
+        }
+
         const QString &name();
         const QString &setName(const QString &t_name);
 
         /**
-         * Get the lowercase name of the field.
+         * Get the case-folded (lowercase) name of the field, for case-insensitive comparisons. It is interned, so this doesn't allocate.
          */
-        const QString lowerName();
+        const QString &lowerName();
+
+        /**
+         * Get the interned name. Two fields from the same table have the same name exactly when their atoms are the same.
+         */
+        const Atom *nameAtom();
 
         const VectorUnion &data();
         const VectorUnion &setData(const VectorUnion &t_data);
@@ -39,6 +74,12 @@ namespace passman {
         QMetaType::Type type();
         QMetaType::Type setType(const QMetaType::Type t_type);
 
+        /**
+         * Get the entry this field belongs to, if any. Changes to the field are reported to it.
+         */
+        PDPPEntry *entry();
+        PDPPEntry *setEntry(PDPPEntry *t_entry);
+
         /**
          * Returns true if the field represents an entry's name.
          */
@@ -53,6 +94,22 @@ namespace passman {
          * Returns true if the field is multi-line.
          */
         bool isMultiLine();
+
+        /**
+         * Append the field as a version 8 record: its name, type and data, each length-prefixed.
+         * @param t_out Vector to append to.
+         */
+        void serialize(VectorUnion &t_out);
+
+        /**
+         * Read a field written by Field::serialize.
+         * @param t_in Data to read from.
+         * @param t_pos Offset to start reading at. Advanced past the field.
+         * @param t_database Database to make the field in, interning its name in the database's table, or nullptr to allocate it with new.
+         *
+         * @return The new field. Throws an std::runtime_error if the record is truncated.
+         */
+        static Field *deserialize(const VectorUnion &t_in, size_t &t_pos, PDPPDatabase *t_database = nullptr);
     };
 }
 
@@ -3,6 +3,8 @@
 #include <botan/cipher_mode.h>
 #include <botan/pwdhash.h>
 
+#include <QMutex>
+
 #include "vector_union.hpp"
 #include "constants.hpp"
 
@@ -12,9 +14,9 @@ namespace passman {
     /** Class for managing password encryption, hashing, etc. as well as keyfiles, benchmarking, and transforming passwords. */
     class KDF
     {
-        uint16_t m_i1;
-        uint16_t m_i2;
-        uint16_t m_i3;
+        uint32_t m_i1;
+        uint32_t m_i2;
+        uint32_t m_i3;
 
         uint8_t m_hmacFunction;
         uint8_t m_hashFunction;
@@ -22,6 +24,12 @@ namespace passman {
 
         VectorUnion m_seed;
         VectorUnion m_keyFile;
+
+        /** The hash function, built on first use and dropped when its parameters change. Guarded so concurrent transforms can share it. */
+        std::unique_ptr<Botan::PasswordHash> m_hasher;
+        QMutex m_hasherMutex;
+
+        const Botan::PasswordHash &hasher();
     public:
         /**
          * Construct a KDF from a parameter map. See KDF::setParams.
@@ -31,6 +39,50 @@ namespace passman {
         KDF() = default;
         virtual ~KDF() = default;
 
+        /**
+         * Returns the nonce length of an encryption option. Looked up once per option, without building a cipher each time.
+         */
+        static size_t nonceLength(uint8_t t_encryptionFunction);
+
+        /**
+         * Returns the maximum key length of an encryption option. Looked up once per option, like KDF::nonceLength.
+         */
+        static size_t keyLength(uint8_t t_encryptionFunction);
+
+        /**
+         * Returns the CPU features Botan detected on this machine, such as "aes_ni", "avx2" or "neon".
+         */
+        static QStringList cpuFeatures();
+
+        /**
+         * Returns true if this machine has hardware AES (AES-NI, ARMv8 AES or POWER8 crypto).
+         */
+        static bool hasHardwareAes();
+
+        /**
+         * Returns true if an encryption option runs in constant time on this machine. Twofish looks up tables indexed by
+         * key-dependent values, which can leak the key through cache timing. So does software AES in Botan before 2.14.
+         */
+        static bool isTimingSafe(uint8_t t_encryptionFunction);
+
+        /**
+         * Measures how fast an encryption option encrypts on this machine, in stream layout sized chunks under a throwaway key.
+         * @param t_encryptionFunction Encryption option to measure.
+         * @param t_msec Roughly how long to measure for, in milliseconds.
+         *
+         * @return Throughput in MB/s.
+         */
+        static double throughput(uint8_t t_encryptionFunction, const int t_msec = 50);
+
+        /**
+         * Recommends an encryption option for a new database: the fastest one on this machine that passes KDF::isTimingSafe.
+         * Usually AES-256/GCM with hardware AES, and ChaCha20-Poly1305 without it.
+         * @param t_msec How long to measure each option for, in milliseconds.
+         *
+         * @return The option's id, for the "encryption" parameter of PDPPDatabase::setParams.
+         */
+        static uint8_t recommendEncryption(const int t_msec = 50);
+
         /**
          * Sets up the KDF's params through a parameter map.
          * @param p Parameter map.
@@ -41,21 +93,31 @@ namespace passman {
          * seed, keyfile
          *
          * i1, i2, and i3's function depend on the selected hash function.
-         * Check their docs for details.
+         * Check their docs for details. For Argon2id, they are memory (in KiB), iterations and lanes;
+         * for Scrypt, N, r and p; Bcrypt-PBKDF only uses i1, its iterations.
          *
          * @return Whether or not setting the parameters was successful.
          */
         bool setParams(const QVariantMap &p);
 
-        uint16_t i1();
-        void setI1(uint16_t t_i1);
-        uint16_t i2();
-        void setI2(uint16_t t_i2);
-        uint16_t i3();
-        void setI3(uint16_t t_i3);
-        uint16_t rounds();
-        uint16_t memoryUsage();
-        uint16_t parallelism();
+        uint32_t i1();
+        void setI1(uint32_t t_i1);
+        uint32_t i2();
+        void setI2(uint32_t t_i2);
+        uint32_t i3();
+        void setI3(uint32_t t_i3);
+        uint32_t rounds();
+
+        /**
+         * Memory used by the hash function, in KiB.
+         */
+        uint32_t memoryUsage();
+
+        /**
+         * Lanes (Argon2id) or parallel instances (Scrypt) of the hash function. Botan 2 computes them one after another,
+         * so raising this raises the cost of each derivation rather than spreading it across cores.
+         */
+        uint32_t parallelism();
 
         uint8_t hmacFunction();
         bool setHmacFunction(uint8_t t_hmacFunction);
@@ -104,7 +166,7 @@ namespace passman {
         std::unique_ptr<Botan::PasswordHash> makeHasher(uint8_t t_hashFunction = 63);
 
         /**
-         * Transform data using the KDF.
+         * Transform data using the KDF. Safe to call from several threads at once.
          * @param t_data Data to transform.
          * @param t_seed Optional seed to use. Defaults to the KDF's seed.
          *
@@ -112,11 +174,20 @@ namespace passman {
          */
         VectorUnion transform(VectorUnion t_data, VectorUnion t_seed = {});
 
+        /**
+         * Times transform() with the KDF's current parameters.
+         * @param t_samples How many derivations to time.
+         *
+         * @return The median time of a derivation, in milliseconds.
+         */
+        double measure(const int t_samples = 3);
+
         /**
          * Benchmarks the KDF.
          * @param t_msec How long the resulting rounds should take in milliseconds.
          *
-         * @return The amount of rounds required for encryption/decryption to take t_msec milliseconds.
+         * @return The amount of rounds required for encryption/decryption to take t_msec milliseconds, scaled linearly from the median of a few derivations.
+         * See PDPPDatabase::calibrateKdf for tuning memory and parallelism too.
          */
         int benchmark(const int t_msec);
 
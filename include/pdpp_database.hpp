@@ -6,57 +6,265 @@
 #include <botan/hash.h>
 #include <botan/cipher_mode.h>
 #include <botan/hex.h>
+#include <botan/mac.h>
+
+#include <QHash>
+#include <QFile>
+#include <QFuture>
+#include <QMutex>
+#include <QThreadPool>
+
+#include <atomic>
+#include <functional>
 
 #include "constants.hpp"
 #include "vector_union.hpp"
 #include "kdf.hpp"
+#include "arena.hpp"
+#include "atom_table.hpp"
+#include "search_index.hpp"
 
 namespace passman {
     class PDPPEntry;
+    class Field;
+    class DataStream;
 
     // TODO: getters and setters for variables
 
     /** Drives all operations related to database access. */
     class PDPPDatabase
     {
+        /** Names of the fields the database makes. Declared before the arena, so it outlives the fields pointing into it. */
+        AtomTable m_atoms;
+
+        /**
+         * Owns the entries and fields the database makes. Declared before everything holding entries, so it's released last.
+         * Reloads swap in a fresh arena and release the old one, so entries from before a reload don't pile up.
+         */
+        std::unique_ptr<Arena> m_arena = std::make_unique<Arena>();
+
         QList<PDPPEntry *> m_entries;
+
+        QHash<QString, PDPPEntry *> m_nameIndex;
+        qsizetype m_shadowedNames = 0;
+
+        QHash<QByteArray, QList<PDPPEntry *>> m_passwordIndex;
+        QHash<PDPPEntry *, QByteArray> m_passwordDigests;
+        std::unique_ptr<Botan::MessageAuthenticationCode> m_passwordMac;
+        bool m_passwordIndexValid = false;
+
+        SearchIndex m_searchIndex;
+        bool m_searchIndexValid = false;
+
+        bool m_oldFormat = false;
+
+        /** Argon2id memory cost in KiB as read from the file, or 0 to use memoryUsage. */
+        uint32_t m_memoryCost = 0;
+        uint32_t memoryCost(const uint32_t t_memoryUsage = 0);
+
+        /** Where an entry's sealed block lives, for databases using the EntryBlocks layout. */
+        struct EntryBlock {
+            quint64 offset;
+            quint32 length;
+            /** The nonce the table records for the block, so an older block sealed for the same entry is refused. */
+            QByteArray nonce;
+        };
+
+        QHash<PDPPEntry *, EntryBlock> m_blocks;
+        size_t m_blocksOffset = 0;
+        VectorUnion m_keyFileKey{};
+
+        QHash<PDPPEntry *, EntryBlock> m_pendingBlocks;
+        size_t m_pendingBlocksOffset = 0;
+        VectorUnion m_sealKey{};
+        VectorUnion m_sealKeyFileKey{};
+        /** The cipher and key file setting the blocks were sealed with, which may have changed since. */
+        uint8_t m_sealEncryption = 0;
+        bool m_sealKeyFile = false;
+
+        /** Where the encrypted data starts in the file. */
+        size_t m_dataOffset = 0;
+
+        /**
+         * The database file, memory-mapped by parse(). While it's mapped, the encrypted data is read in place from m_mapped
+         * rather than copied into data. It is unmapped before the file is written.
+         */
+        std::unique_ptr<QFile> m_mapFile;
+        ByteView m_mapped;
+
+        /** Serializes writes to the file. Saves are numbered, and one is skipped if a later one has already been written. */
+        QMutex m_saveMutex;
+        quint64 m_saveSequence = 0;
+        quint64 m_writtenSequence = 0;
+        /** Background saves and opens that haven't finished yet; the destructor waits on them. */
+        QList<QFuture<void>> m_tasks;
+        void trackTask(const QFuture<void> &t_task);
+
+        PDPPDatabase *snapshot();
+
+        int unlock(const QString &t_password, const QString &t_keyFile, const std::function<bool(int, const QString &)> &t_stage);
+
+        bool replayInto(const QSqlDatabase &t_sql);
+        QList<Field *> readTable(const QSqlDatabase &t_sql, const QString &t_table);
+        void loadSqlEntries();
+
+        ByteView mapFile();
+        void unmap();
+        ByteView cipherText();
+
+        void sealStream(const VectorUnion &t_keyFileKey, const std::function<void(const secvec &)> &t_sink);
+        int decryptStream(const VectorUnion &t_key, const VectorUnion &t_keyFileKey, const bool t_load);
+
+        /** The first stream chunk, kept from checking the keys so loading the entries doesn't decrypt it again. */
+        struct StreamHead {
+            secvec plain;
+            secvec prefix;
+            /** Offset of the ciphertext following the chunk. */
+            size_t end = 0;
+            bool last = false;
+            VectorUnion key{};
+            VectorUnion keyFileKey{};
+        };
+        std::unique_ptr<StreamHead> m_streamHead;
+
+        void writeHeader(DataStream &pd);
+
+        /** The KDF returned by makeKdf(), kept until the parameters it was built from change. */
+        std::shared_ptr<KDF> m_kdf;
+        QVariantMap m_kdfParams;
+        QMutex m_kdfMutex;
+        QVariantMap kdfParams(uint8_t t_hmac, uint8_t t_hash, uint8_t t_encryption, const VectorUnion &t_seed, const VectorUnion &t_keyFile, uint8_t t_hashIters,
+                              uint32_t t_memoryUsage);
+
+        /** A keyed cipher, only looked up by name again when the encryption option changes, and only rekeyed when the key does. */
+        struct KeyedCipher {
+            std::unique_ptr<Botan::Cipher_Mode> mode;
+            VectorUnion key{};
+            uint8_t encryption = 0;
+        };
+
+        /** Ciphers for the password and key file layers, shared by every encryption and decryption. */
+        KeyedCipher m_enc;
+        KeyedCipher m_keyEnc;
+        KeyedCipher m_dec;
+        KeyedCipher m_keyDec;
+        /** Ciphers for unloaded entry blocks, which stay under the seal keys until the next save. */
+        KeyedCipher m_blockDec;
+        KeyedCipher m_blockKeyDec;
+        Botan::Cipher_Mode &cipher(KeyedCipher &t_cache, const Botan::Cipher_Dir t_direction, const VectorUnion &t_key);
+        Botan::Cipher_Mode &cipher(KeyedCipher &t_cache, const Botan::Cipher_Dir t_direction, const VectorUnion &t_key, const uint8_t t_encryption);
+
+        VectorUnion deriveKeyFileKey(const std::shared_ptr<KDF> &t_kdf, const std::function<void()> &t_work);
+        void prepareRecords();
+        void loadBlocks();
+
+        VectorUnion encryptedBlocks(const VectorUnion &t_keyFileKey);
+        int decryptBlockTable(const VectorUnion &t_key, const VectorUnion &t_keyFileKey);
+        void loadBlockTable(const VectorUnion &t_table);
+
+        friend class ArenaReload;
+        void reloaded(const QList<PDPPEntry *> &t_entries, const QHash<PDPPEntry *, EntryBlock> &t_blocks = {});
+        void waitForTasks();
+        /** Everything close() does but waiting for background tasks, for tasks that need to close the database themselves. */
+        void discard();
+
+        void indexEntry(PDPPEntry *t_entry);
+        void unindexEntry(PDPPEntry *t_entry, const QString &t_name);
+        void rebuildIndex();
+
+        QByteArray passwordDigest(const VectorUnion &t_pass);
+        void indexPassword(PDPPEntry *t_entry);
+        void unindexPassword(PDPPEntry *t_entry);
+        void buildPasswordIndex();
+        void buildSearchIndex();
     public:
+        /** A vault to open with PDPPDatabase::openBatch. */
+        struct UnlockRequest {
+            QString path;
+            QString password;
+            QString keyFile;
+        };
+
+        /** The outcome of opening one vault with PDPPDatabase::openBatch. */
+        struct UnlockResult {
+            QString path;
+            /** The opened database, owned by the caller, or nullptr if opening failed. */
+            PDPPDatabase *database = nullptr;
+            /** A return code, as for PDPPDatabase::openAsync. */
+            int result = 0;
+        };
+
         /**
          * Construct a database from a parameter map. See PDPPDatabase::setParams.
          * @param p Parameter map.
          */
         PDPPDatabase(const QVariantMap &p);
         PDPPDatabase() = default;
-        virtual ~PDPPDatabase() = default;
+        /** Waits for any saves or opens still running in the background, then releases the entries and fields in the arena. */
+        virtual ~PDPPDatabase();
 
         /**
-         * Encrypt the database and set it to be modified.
+         * Close the vault: wait for background saves, then drop every entry and release the arena, wiping the entries and fields in it.
+         * Decrypted data, keys and the vault's field names are cleared too. Pointers to the database's entries and fields are invalid afterwards.
          */
-        inline void save() {
-            this->encrypt();
+        void close();
 
-            this->modified = false;
+        /**
+         * The arena holding the database's entries and fields. Everything the database loads is made here.
+         * Entries and fields created with new stay owned by whoever created them.
+         */
+        inline Arena &arena() {
+            return *this->m_arena;
         }
 
+        /**
+         * The table the names of the database's fields are interned in. Only names of fields the database made are here.
+         */
+        inline AtomTable &atoms() {
+            return this->m_atoms;
+        }
+
+        /**
+         * Make an entry in the database's arena. It is freed when the database is closed, reloaded or destroyed, so never delete it.
+         * @param t_fields The entry's fields. Leave empty for the default fields.
+         */
+        PDPPEntry *makeEntry(QList<Field *> t_fields = {});
+
+        /**
+         * Make a field in the database's arena, like PDPPDatabase::makeEntry. Its name is interned in PDPPDatabase::atoms.
+         */
+        Field *makeField(const QString &t_name, const VectorUnion &t_data, const QMetaType::Type t_type);
+
+        /**
+         * Encrypt the database and set it to be unmodified.
+         * Only entries that changed since the last save are serialized again; the rest reuse their cached records.
+         * The file is replaced atomically. Throws an std::runtime_error if it can't be written, leaving the old file intact.
+         */
+        void save();
+
+        /**
+         * Save the database on a worker thread, returning immediately.
+         *
+         * A snapshot of the parameters and entries is taken first, so the database can keep being edited (and saved again)
+         * while the save runs. Clean entries are snapshotted as their cached records; only dirty ones copy their fields.
+         * The database is set to be unmodified straight away, and set back to modified if the save fails.
+         *
+         * @return A future holding whether or not the save was successful.
+         */
+        QFuture<bool> saveAsync();
+
         /**
          * Add an entry to the database.
          * @param entry Entry to add.
          */
-        inline void addEntry(PDPPEntry *entry) {
-            this->m_entries.emplaceBack(entry);
-            this->modified = true;
-        }
+        void addEntry(PDPPEntry *entry);
 
         /**
          * Remove an entry from the database.
          * @param entry Entry to remove.
          * @return Whether or not removing the entry was successful.
          */
-        inline bool removeEntry(PDPPEntry *entry) {
-            bool ok = this->m_entries.removeOne(entry);
-            this->modified = ok;
-            return ok;
-        }
+        bool removeEntry(PDPPEntry *entry);
 
         /**
          * Return the amount of entries in the database.
@@ -65,14 +273,33 @@ namespace passman {
             return this->m_entries.length();
         }
 
+        /**
+         * Return the database's entries.
+         * Modifying the list directly bypasses the name index; use addEntry(), removeEntry() or setEntries() instead.
+         */
         inline QList<PDPPEntry *> &entries() {
             return this->m_entries;
         }
 
-        inline void setEntries(QList<PDPPEntry *> t_entries) {
-            this->m_entries = t_entries;
-            this->modified = true;
-        }
+        /**
+         * Replace the database's entries and rebuild the name index.
+         * @param t_entries New entries.
+         */
+        void setEntries(QList<PDPPEntry *> t_entries);
+
+        /**
+         * Update the name index after an entry was renamed. Called by PDPPEntry::setName.
+         * @param t_entry The renamed entry.
+         * @param t_oldName The entry's previous name.
+         */
+        void renameEntry(PDPPEntry *t_entry, const QString &t_oldName);
+
+        /**
+         * Update the password and search indexes after one of an entry's fields changed. Called by PDPPEntry::fieldChanged.
+         * @param t_entry The changed entry.
+         * @param t_field The changed field, or nullptr if the entry's field list was replaced.
+         */
+        void entryChanged(PDPPEntry *t_entry, Field *t_field);
 
         /**
          * Sets up the databases's params through a parameter map.
@@ -97,14 +324,58 @@ namespace passman {
         PDPPEntry *entryWithPassword(const QString &t_pass);
 
         /**
-         * Turns SQL statements from the global SQL database into entries.
+         * Returns every group of entries that share a password. Entries with an empty password are ignored.
+         * The index this relies on is keyed by a per-session HMAC of each password, so no plaintext is kept in it.
+         */
+        QList<QList<PDPPEntry *>> reusedPasswords();
+
+        /**
+         * Find the fields whose data contains t_query, ignoring case. Passwords and OTP secrets aren't searched.
+         * Uses a trigram index kept in secure memory and updated as fields change; it's built on the first search, or when entries are
+         * loaded if searchIndex is set. Building it loads every stub entry.
+         * @param t_query Text to look for.
+         *
+         * @return The matching fields and their entries, in no particular order.
+         */
+        QList<SearchHit> search(const QString &t_query);
+
+        /**
+         * Turns the tables of the global SQL database into entries.
+         * Entries are created as stubs holding only their name; each one's fields are read from its table on first access.
+         * The tables must therefore stay in place until every entry needed has been loaded.
          */
         void get();
 
         /**
-         * Turns entries into SQL statements.
+         * Reads a stub entry's fields, either by decrypting its block (EntryBlocks layout) or from its table in the global SQL database.
+         * Called by PDPPEntry when a stub is first accessed. Throws an std::runtime_error if the entry's block fails to decrypt.
+         * @param t_entry The entry to load.
+         *
+         * @return The entry's fields.
+         */
+        QList<Field *> loadFields(PDPPEntry *t_entry);
+
+        /**
+         * Serializes every named entry into a version 8 payload: an entry count followed by each entry's record.
          *
-         * @return Whether or not it was successful.
+         * @return The payload.
+         */
+        VectorUnion serializeEntries();
+
+        /**
+         * Replaces the database's entries with those read from a version 8 payload.
+         * @param t_payload Payload written by PDPPDatabase::serializeEntries.
+         *
+         * Throws an std::runtime_error if the payload is malformed.
+         */
+        void loadEntries(const VectorUnion &t_payload);
+
+        /**
+         * Turns entries into SQL statements, writing them to the global SQL database in a single transaction.
+         * Values are bound through prepared statements, and only tables whose schema changed are rebuilt.
+         * stList is set to the equivalent version 7 statement text.
+         *
+         * @return Whether or not every statement was successful.
          */
         bool saveSt();
 
@@ -131,18 +402,42 @@ namespace passman {
         VectorUnion encryptedData();
 
 	/**
-	 * Encrypt and write data.
+	 * Encrypt and write data. With the Stream layout, data is encrypted straight to disk a chunk at a time.
 	 */
         void encrypt();
 
+	/**
+	 * Write the header and the current encrypted data to disk.
+	 * If the data is still mapped from the file, it's copied into data first.
+	 */
+        void write();
+
 	/**
 	 * Verifies if the password is correct for the database.
+	 * With a key file, the password and key file keys are derived at the same time on separate threads, using twice the memory.
 	 * @param t_password Password to check.
 	 *
 	 * @return A return code: 3 if the key file is invalid, 0 if the password is invalid, 1 if everything is valid.
 	 */
         int verify(const VectorUnion &t_password);
 
+	/**
+	 * Decrypts and decompresses the database's data with already-derived keys.
+	 * With the Stream layout, only the first chunk is decrypted to check the keys; decrypt() streams in the entries.
+	 * @param t_key The transformed password.
+	 * @param t_keyFileKey The transformed key file contents, if a key file is required.
+	 *
+	 * @return A return code: 3 if the key file is invalid, 0 if the password is invalid, 1 if everything is valid.
+	 */
+        int decryptData(const VectorUnion &t_key, const VectorUnion &t_keyFileKey = {});
+
+	/**
+	 * Replays the decrypted SQL statements into the global SQL database.
+	 *
+	 * @return Whether or not every statement executed successfully.
+	 */
+        bool replay();
+
     /**
      * Decrypts data from disk.
      * @param t_options PasswordOptions flags; Open (load data into Database) and/or Convert (convert from pre-2.0.0 database).
@@ -155,7 +450,7 @@ namespace passman {
         bool decrypt(PasswordOptionsFlag t_options = PasswordOptions(), const VectorUnion &t_password = "", const VectorUnion &t_keyFile = {});
 
 	/**
-	 * Parses a database.
+	 * Parses a database. The file is memory-mapped and the header read in place; the encrypted data is left in the mapping until it's decrypted.
 	 *
 	 * @return 2 if the database needs to be converted, 1 if successful. If unsuccessful, an std::runtime_error is thrown.
 	 */
@@ -170,6 +465,38 @@ namespace passman {
 	 */
         int open(const QString &t_password, const QString &t_keyFile);
 
+	/**
+	 * Opens the database on a worker thread, returning immediately.
+	 * @param t_password Password for the database.
+	 * @param t_keyFile Key file, if present.
+	 *
+	 * The returned future reports progress through its progress value and text, one step per stage: reading the file,
+	 * deriving the keys (the slow part with high-memory Argon2 settings), decrypting, and loading entries.
+	 * Cancelling the future stops the open at the next stage boundary and closes the database as close() does: the file is unmapped and
+	 * any keys or data decrypted so far are wiped, while the header fields keep the values read from the file. A key derivation that's
+	 * already running can't be interrupted, but its result is thrown away.
+	 *
+	 * Version 7 databases are replayed into a private SQL connection and loaded eagerly, so the global one is never touched off its thread.
+	 * Pre-2.0.0 databases must be converted with open() instead.
+	 * The database must not be used until the future finishes.
+	 *
+	 * @return A future holding a return code: 3 if the key file is invalid, 2 if the database needs converting,
+	 * 0 if the password is invalid or opening failed, 1 if successful. Cancelled futures hold no result.
+	 */
+        QFuture<int> openAsync(const QString &t_password, const QString &t_keyFile);
+
+	/**
+	 * Opens many databases at once, one per task on a thread pool, and waits for all of them.
+	 * @param t_vaults The databases to open.
+	 * @param t_pool Pool to open them on. Each open holds a thread (and, for Argon2id, its memory cost) until it's done,
+	 * so the pool's thread count bounds both. It must not be the pool this is called from.
+	 *
+	 * Opens go through the same path as openAsync(), so they never touch the global SQL connection.
+	 *
+	 * @return One result per vault, in the same order.
+	 */
+        static QList<UnlockResult> openBatch(const QList<UnlockRequest> &t_vaults, QThreadPool *t_pool = QThreadPool::globalInstance());
+
 	/**
 	 * Save the database to a new location, and update the database's set path to the new location.
 	 * @param t_fileName New file path for the database.
@@ -178,17 +505,40 @@ namespace passman {
 	 */
         int saveAs(const QString &t_fileName);
 
+	/**
+	 * Returns the database's parameters as a map for PDPPDatabase::setParams.
+	 */
+        QVariantMap params();
+
+	/**
+	 * Finds the strongest parameters for the database's hash function that keep a key derivation within t_msec milliseconds on this machine.
+	 * @param t_msec Target derivation time, in milliseconds.
+	 * @param t_maxMemory Most memory a derivation may use, in MB.
+	 *
+	 * Every candidate is timed as the median of a few derivations. Memory is raised first, since it's what makes Argon2id and Scrypt
+	 * expensive to attack; iterations (Argon2id, Bcrypt-PBKDF) or parallelism (Scrypt) only go up once memory hits t_maxMemory.
+	 * Argon2id keeps a single lane, since Botan 2 doesn't run lanes in parallel. Each search step jumps to the linear estimate and bisects from there, so calibration
+	 * takes a few dozen derivations.
+	 *
+	 * @return The database's parameters, with "hashiters", "memory" and "parallelism" tuned. Pass them to setParams() before deriving the key.
+	 */
+        QVariantMap calibrateKdf(const int t_msec, const uint32_t t_maxMemory = 1024);
+
 	/**
 	 * Make a KDF using the database params or custom parameters. Like KDF::makeDecryptor() and similar,
      * set the functions to 63 to use the database parameters. Set the seed and key file to an empty VectorUnion
      * to use the database's IV/key file. Set hash iterations or memory usage to 0 to use the database parameters.
 	 *
-	 * @return The generated KDF.
+	 * The KDF is shared with the database and reused by later calls with the same parameters, so its hash function is only set up once.
+	 * A call with different parameters replaces the database's KDF, but the one returned stays alive as long as it's held.
+	 *
+	 * @return The KDF.
 	 */
-        KDF *makeKdf(uint8_t t_hmac = 63, uint8_t t_hash = 63, uint8_t t_encryption = 63, VectorUnion t_seed = {}, VectorUnion t_keyFile = {}, uint8_t t_hashIters = 0, uint16_t t_memoryUsage = 0);
+        std::shared_ptr<KDF> makeKdf(uint8_t t_hmac = 63, uint8_t t_hash = 63, uint8_t t_encryption = 63, VectorUnion t_seed = {}, VectorUnion t_keyFile = {}, uint8_t t_hashIters = 0, uint32_t t_memoryUsage = 0);
 
         bool keyFile = false;
-        bool modified = false;
+        /** Atomic, since a failed saveAsync() restores it from its worker thread. */
+        std::atomic<bool> modified = false;
 
         uint8_t hmac = 0;
         uint8_t hash = 0;
@@ -196,10 +546,22 @@ namespace passman {
         uint8_t encryption = 0;
         uint8_t version = Constants::maxVersion;
 
-        uint16_t memoryUsage = 64;
+        /** Argon2id memory usage, in MB. Once a database is opened, the exact cost read from its file is used until setParams() is called. */
+        uint32_t memoryUsage = 64;
+        /** Argon2id lanes or Scrypt's p. Only version 8 databases store it; older ones always use 1. */
+        uint8_t parallelism = 1;
         uint8_t clearSecs = 15;
 
-        bool compress = true;
+        /** Compression option; see Constants::compressionMatch. Version 7 databases only support none and gzip. */
+        uint8_t compress = 1;
+        /** Compression level, or 0 for the algorithm's default. Only version 8 databases store it. */
+        uint8_t compressionLevel = 0;
+
+        /** Build the search index as soon as entries are loaded, instead of on the first search(). Stub entries lose their laziness. */
+        bool searchIndex = false;
+
+        /** Layout of the encrypted data; see DataLayout. Only version 8 databases support EntryBlocks and Stream. */
+        uint8_t layout = SinglePayload;
 
         VectorUnion iv{};
         size_t ivLen = 12;
@@ -212,6 +574,7 @@ namespace passman {
         VectorUnion path = "";
         VectorUnion keyFilePath = "";
 
+        /** The decrypted payload: SQL statements for version 7 and below, entry records for version 8. */
         VectorUnion stList = "";
         VectorUnion passw{};
     };
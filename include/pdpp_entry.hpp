@@ -1,6 +1,8 @@
 #ifndef PDPPENTRY_H
 #define PDPPENTRY_H
 
+#include <QHash>
+
 #include "field.hpp"
 
 // TODO: DOCS
@@ -28,56 +30,169 @@ namespace passman {
     class PDPPEntry
     {
         QList<Field *> m_fields;
-        PDPPDatabase *m_database;
+        /** Case-folded field names to the first field with that name, built on the first lookup after the fields change. */
+        QHash<QString, Field *> m_fieldIndex;
+        bool m_fieldIndexValid = false;
+        PDPPDatabase *m_database = nullptr;
         QString m_name;
+        bool m_loaded = true;
+
+        bool m_dirty = true;
+        VectorUnion m_record{};
+        VectorUnion m_sealed{};
+
+        void load();
     public:
         /**
          * Create an entry with the specified fields, owned by the specified database.
+         * With no fields, the default ones are created with new, like an entry created with new. PDPPDatabase::makeEntry makes them in the arena.
          */
         PDPPEntry(QList<Field *> t_fields, PDPPDatabase *t_database);
+
+        /**
+         * Make the default fields of a new entry: Name, Email, URL, Notes, Password and OTP, all empty.
+         * @param t_database Database to make them in, or nullptr to create them with new.
+         */
+        static QList<Field *> defaultFields(PDPPDatabase *t_database);
         PDPPEntry() = default;
         virtual ~PDPPEntry() = default;
 
-        inline void addField(Field *t_field) {
-            this->m_fields.emplaceBack(t_field);
+        /**
+         * Create an entry that only knows its name. Its fields are loaded from the database the first time they are accessed.
+         * @param t_name Name of the entry.
+         * @param t_database Database that owns the entry and loads its fields.
+         */
+        static PDPPEntry *stub(const QString &t_name, PDPPDatabase *t_database);
+
+        /**
+         * Make a detached copy of the entry for saving, owned by t_database and made in its arena.
+         * Clean entries only copy their cached record and sealed block; dirty ones copy their fields. Stubs stay stubs.
+         */
+        PDPPEntry *snapshot(PDPPDatabase *t_database);
+
+        /**
+         * Returns true once the entry's fields are in memory.
+         */
+        inline bool isLoaded() {
+            return this->m_loaded;
         }
 
-        inline bool removeField(Field *t_field) {
-            return this->m_fields.removeOne(t_field);
+        /**
+         * Load the entry's fields if they haven't been loaded yet.
+         */
+        inline void ensureLoaded() {
+            if (!this->m_loaded) {
+                load();
+            }
         }
 
+        void addField(Field *t_field);
+
+        bool removeField(Field *t_field);
+
         inline qsizetype indexOf(Field *t_field) {
+            ensureLoaded();
             return this->m_fields.indexOf(t_field);
         }
 
         /**
-         * Get a named field.
-         * @param t_name The field to get.
-         * @return The field with the specified name.
+         * Get a named field, ignoring case. Looked up in the entry's field index, so it takes constant time.
+         * @param t_name The field to get. Lowercase names are used as they are; others are case-folded first, which allocates.
+         * @return The first field with the specified name, or Field::notFound() if there is none.
          */
-        inline Field *fieldNamed(QString t_name) {
-            for (Field *f : this->m_fields) {
-                if (f->lowerName() == t_name.toLower()) {
-                    return f;
-                }
-            }
-            return new Field("", "", QMetaType::QString);
-        }
+        Field *fieldNamed(const QString &t_name);
 
         inline Field *fieldAt(const int t_index) {
+            ensureLoaded();
             return this->m_fields[t_index];
         }
 
         inline const QList<Field *> &fields() {
+            ensureLoaded();
             return this->m_fields;
         }
 
-        inline QList<Field *> &setFields(QList<Field *> &t_fields) {
-            this->m_fields = t_fields;
-            return t_fields;
+        QList<Field *> &setFields(QList<Field *> &t_fields);
+
+        /**
+         * Report a change to one of the entry's fields to its database. Called by Field's setters.
+         */
+        void fieldChanged(Field *t_field);
+
+        /**
+         * Drop the field index after one of the entry's fields was renamed. Called by Field::setName.
+         */
+        inline void fieldRenamed(Field *) {
+            this->m_fieldIndexValid = false;
+        }
+
+        /**
+         * Append the entry as a version 8 record: its field count, followed by each field's record.
+         * The record is cached, and only rebuilt after the entry or one of its fields changes.
+         * @param t_out Vector to append to.
+         */
+        void serialize(VectorUnion &t_out);
+
+        /**
+         * Get the entry's version 8 record, rebuilding it only if the entry is dirty.
+         */
+        const VectorUnion &record();
+
+        /**
+         * Returns true if the entry or any of its fields changed since it was last serialized or read.
+         * Only field setters, setName() and setFields() make an entry dirty.
+         */
+        inline bool isDirty() {
+            return this->m_dirty;
+        }
+
+        /**
+         * Seed the cached record, and optionally the sealed block, with what was read from disk, marking the entry clean.
+         * Called when an entry is deserialized or its block is opened.
+         */
+        void setCachedRecord(VectorUnion t_record, VectorUnion t_sealed = {});
+
+        /**
+         * Mark the entry as changed, dropping its cached record and sealed block.
+         */
+        void markDirty();
+
+        /**
+         * Get the entry's cached sealed block (EntryBlocks layout), or an empty vector if it must be sealed again.
+         */
+        inline const VectorUnion &sealedBlock() {
+            return this->m_sealed;
+        }
+
+        /**
+         * Cache the entry's sealed block. Called by PDPPDatabase when saving with the EntryBlocks layout.
+         */
+        inline void setSealedBlock(const VectorUnion &t_sealed) {
+            this->m_sealed = t_sealed;
         }
 
+        /**
+         * Read an entry written by PDPPEntry::serialize.
+         * @param t_in Data to read from.
+         * @param t_pos Offset to start reading at. Advanced past the entry.
+         * @param t_database Database that will own the entry. The entry and its fields are made in its arena.
+         *
+         * @return The new entry. Throws an std::runtime_error if the record is truncated or has no fields.
+         */
+        static PDPPEntry *deserialize(const VectorUnion &t_in, size_t &t_pos, PDPPDatabase *t_database);
+
+        /**
+         * Read the fields of an entry written by PDPPEntry::serialize, without creating the entry.
+         * @param t_in Data to read from.
+         * @param t_pos Offset to start reading at. Advanced past the entry.
+         * @param t_database Database to make the fields in, or nullptr to allocate them with new.
+         *
+         * @return The fields. Throws an std::runtime_error if the record is truncated or has no fields.
+         */
+        static QList<Field *> deserializeFields(const VectorUnion &t_in, size_t &t_pos, PDPPDatabase *t_database = nullptr);
+
         inline qsizetype fieldLength() {
+            ensureLoaded();
             return this->m_fields.length();
         }
 
@@ -94,10 +209,10 @@ namespace passman {
             return this->m_name;
         }
 
-        inline QString &setName(QString &t_name) {
-            this->m_name = t_name;
-            return t_name;
-        }
+        /**
+         * Rename the entry, keeping its database's name index up to date. Stubs are loaded first, since their name is part of their sealed block.
+         */
+        QString &setName(QString &t_name);
 
         /*
          * Override this function in your implementation to open an entry editing dialog, take parameters, etc.
@@ -0,0 +1,84 @@
+#ifndef SEARCHINDEX_H
+#define SEARCHINDEX_H
+#include <botan/secmem.h>
+#include <QList>
+#include <QString>
+
+#include <unordered_map>
+#include <vector>
+
+namespace passman {
+    class PDPPEntry;
+    class Field;
+
+    /** A field matched by a search, with the entry holding it. */
+    struct SearchHit {
+        PDPPEntry *entry;
+        Field *field;
+    };
+
+    /**
+     * Trigram index over the case-folded data of entries' fields, for substring searches.
+     * Trigrams give away what the fields hold, so everything is kept in Botan's secure memory and wiped as it's freed.
+     * Passwords and OTP secrets are never indexed.
+     */
+    class SearchIndex
+    {
+        /** Three UTF-16 code units, packed. */
+        using Trigram = quint64;
+
+        template <typename T>
+        using SecureList = std::vector<T, Botan::secure_allocator<T>>;
+
+        template <typename K, typename V>
+        using SecureMap = std::unordered_map<K, V, std::hash<K>, std::equal_to<K>, Botan::secure_allocator<std::pair<const K, V>>>;
+
+        /** Fields holding each trigram, sorted by address so lists intersect with a merge. */
+        SecureMap<Trigram, SecureList<Field *>> m_postings;
+        /** Trigrams of each indexed field, to take it out again when it changes. */
+        SecureMap<Field *, SecureList<Trigram>> m_fieldTrigrams;
+        /** Indexed fields of each entry in the index. */
+        SecureMap<PDPPEntry *, SecureList<Field *>> m_entryFields;
+
+        static SecureList<Trigram> trigrams(const QString &t_text);
+        static bool indexable(Field *t_field);
+
+        void addField(PDPPEntry *t_entry, Field *t_field, const bool t_sorted);
+        void removeField(PDPPEntry *t_entry, Field *t_field);
+    public:
+        /**
+         * Replace the index with one over every field of t_entries. Stub entries are loaded.
+         */
+        void build(const QList<PDPPEntry *> &t_entries);
+
+        /**
+         * Empty the index, wiping it.
+         */
+        void clear();
+
+        /**
+         * Returns true if the entry is in the index.
+         */
+        bool contains(PDPPEntry *t_entry) const;
+
+        void addEntry(PDPPEntry *t_entry);
+        void removeEntry(PDPPEntry *t_entry);
+
+        /**
+         * Reindex a field after it changed, was added to the entry or was removed from it.
+         * @param t_entry The entry the field belongs (or belonged) to.
+         * @param t_field The changed field, or nullptr to reindex the whole entry.
+         */
+        void updateField(PDPPEntry *t_entry, Field *t_field);
+
+        /**
+         * Find the fields whose data contains t_query, ignoring case.
+         * Queries shorter than three characters have no trigrams, so they check every indexed field.
+         *
+         * @return The matching fields and their entries, in no particular order.
+         */
+        QList<SearchHit> search(const QString &t_query) const;
+    };
+}
+
+#endif // SEARCHINDEX_H
@@ -0,0 +1,117 @@
+#ifndef STREAMCIPHER_H
+#define STREAMCIPHER_H
+#include <functional>
+#include <botan/cipher_mode.h>
+#include <botan/rng.h>
+
+#include "extra.hpp"
+
+namespace passman {
+    /**
+     * Encrypts data as a sequence of fixed-size, individually authenticated chunks (the STREAM construction),
+     * so that neither side ever needs to hold more than one chunk.
+     *
+     * Output is a random nonce prefix, followed by frames of: 4 bytes (little-endian) ciphertext length, 1 byte "last chunk" flag, and the ciphertext.
+     * Each chunk's nonce is the prefix, the chunk's index (4 bytes, big-endian), and the last chunk flag.
+     */
+    class StreamEncryptor
+    {
+    public:
+        typedef std::function<void(const secvec &)> Sink;
+
+        /**
+         * @param t_enc Keyed encryptor for the password layer.
+         * @param t_keyEnc Keyed encryptor for the key file layer, or nullptr if there is none.
+         * @param t_rng RNG for the nonce prefix.
+         * @param t_sink Called with every piece of output, in order.
+         */
+        StreamEncryptor(Botan::Cipher_Mode &t_enc, Botan::Cipher_Mode *t_keyEnc, Botan::RandomNumberGenerator &t_rng, Sink t_sink);
+
+        /**
+         * Encrypt more plaintext. Output is passed to the sink as chunks fill up.
+         */
+        void update(const uint8_t *t_data, const size_t t_len);
+
+        /**
+         * Encrypt the remaining plaintext as the last chunk.
+         */
+        void finish();
+
+    private:
+        void sealChunk(secvec &t_chunk, const bool t_last);
+
+        Botan::Cipher_Mode &m_enc;
+        Botan::Cipher_Mode *m_keyEnc;
+        Sink m_sink;
+
+        secvec m_prefix;
+        secvec m_buffer;
+        uint32_t m_counter = 0;
+    };
+
+    /**
+     * Decrypts the output of a StreamEncryptor, a piece at a time.
+     */
+    class StreamDecryptor
+    {
+    public:
+        typedef std::function<void(secvec &)> Sink;
+
+        /**
+         * @param t_dec Keyed decryptor for the password layer.
+         * @param t_keyDec Keyed decryptor for the key file layer, or nullptr if there is none.
+         * @param t_sink Called with every decrypted chunk, in order. It may consume the chunk's contents.
+         */
+        StreamDecryptor(Botan::Cipher_Mode &t_dec, Botan::Cipher_Mode *t_keyDec, Sink t_sink);
+
+        /**
+         * Decrypt more ciphertext. Complete chunks are authenticated and passed to the sink.
+         *
+         * @return 3 if a chunk fails the key file layer, 0 if it fails the password layer, 1 otherwise.
+         * Throws an std::runtime_error if the framing is invalid.
+         */
+        int update(const uint8_t *t_data, const size_t t_len);
+
+        /**
+         * Check that the stream ended with its last chunk. Throws an std::runtime_error if it was truncated or has trailing data.
+         */
+        void finish();
+
+        /**
+         * Returns the amount of chunks authenticated so far.
+         */
+        uint32_t chunks();
+
+        /**
+         * Returns true once the last chunk has been authenticated.
+         */
+        bool finished();
+
+        /**
+         * Returns the stream's nonce prefix, or an empty vector if it hasn't been read yet.
+         */
+        const secvec &prefix();
+
+        /**
+         * Pick up a stream whose first chunks were already authenticated by another decryptor.
+         * Feed update() the ciphertext that follows them.
+         * @param t_prefix The stream's nonce prefix.
+         * @param t_chunks The number of chunks already authenticated.
+         * @param t_finished Whether the last of them was the last chunk.
+         */
+        void resume(const secvec &t_prefix, const uint32_t t_chunks, const bool t_finished);
+
+    private:
+        Botan::Cipher_Mode &m_dec;
+        Botan::Cipher_Mode *m_keyDec;
+        Sink m_sink;
+
+        size_t m_prefixLen;
+        secvec m_prefix;
+        secvec m_buffer;
+        uint32_t m_counter = 0;
+        bool m_finished = false;
+    };
+}
+
+#endif // STREAMCIPHER_H
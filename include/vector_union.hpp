@@ -9,16 +9,26 @@ namespace passman {
      * Helper class which stores a Botan::secure_vector<uint8_t>.
      * Primary use is secure storage of many different types, allowing for assignment and conversion to/from these types. Supported types include:
      * QString, std::string, const char *, secure vector, QVariant, bool, and double
+     *
+     * Conversions to and from strings and byte arrays copy the bytes once, with no intermediate std::string. Strings are UTF-8.
      */
     class VectorUnion : public secvec
     {
     public:
         VectorUnion() = default;
         virtual ~VectorUnion() = default;
+
+        VectorUnion(const VectorUnion &) = default;
+        VectorUnion(VectorUnion &&) = default;
+        VectorUnion &operator=(const VectorUnion &) = default;
+        VectorUnion &operator=(VectorUnion &&) = default;
+
         VectorUnion(const QString &data);
         VectorUnion(const std::string &data);
         VectorUnion(const char *data, const int length = 0);
         VectorUnion(const secvec &data);
+        VectorUnion(secvec &&data);
+        VectorUnion(const ByteView &data);
 
         VectorUnion(const std::vector<uint8_t> &data);
 
@@ -31,8 +41,14 @@ namespace passman {
         QString asQStr() const;
         std::string asStdStr() const;
         QVariant asQVariant() const;
+        /** All of the bytes, including any NULs. */
         QByteArray asQByteArray() const;
 
+        /** A view of the bytes. Valid until the VectorUnion is changed or destroyed. */
+        inline ByteView view() const {
+            return {this->data(), this->size()};
+        }
+
         VectorUnion hex_encode() const;
         VectorUnion hex_decode() const;
 
@@ -42,7 +58,10 @@ namespace passman {
         explicit operator bool() const;
         explicit operator double() const;
 
-        VectorUnion &operator+=(QString s);
+        /** Append a string's UTF-8 bytes in place. */
+        VectorUnion &operator+=(const QString &s);
+        /** Append bytes in place. */
+        VectorUnion &operator+=(const ByteView &s);
     };
 }
 #endif // VECTORUNION_H
@@ -0,0 +1,86 @@
+#include <botan/mem_ops.h>
+
+#include <algorithm>
+#include <cstdint>
+
+#include "arena.hpp"
+
+namespace passman {
+    // Holds a few hundred fields, and is small enough to come from Botan's locked memory pool while it lasts.
+    static constexpr size_t chunkSize = 64 * 1024;
+
+    Arena::~Arena() {
+        release();
+    }
+
+    void *Arena::allocate(const size_t t_size, const size_t t_align) {
+        QMutexLocker lock(&m_mutex);
+
+        auto aligned = [t_align](const uint8_t *t_ptr) {
+            const uintptr_t addr = reinterpret_cast<uintptr_t>(t_ptr);
+            return (addr + t_align - 1) / t_align * t_align - addr;
+        };
+
+        if (!m_chunks.empty()) {
+            const Chunk &chunk = m_chunks.back();
+            const size_t offset = m_used + aligned(chunk.data + m_used);
+
+            if (offset + t_size <= chunk.size) {
+                m_used = offset + t_size;
+                return chunk.data + offset;
+            }
+        }
+
+        // Oversized objects get a chunk of their own.
+        const size_t size = std::max(chunkSize, t_size + t_align);
+        m_chunks.push_back({static_cast<uint8_t *>(Botan::allocate_memory(size, 1)), size});
+
+        const Chunk &chunk = m_chunks.back();
+        const size_t offset = aligned(chunk.data);
+        m_used = offset + t_size;
+
+        return chunk.data + offset;
+    }
+
+    void Arena::adopt(void *t_object, void (*t_destroy)(void *)) {
+        QMutexLocker lock(&m_mutex);
+        m_objects.emplace_back(t_object, t_destroy);
+    }
+
+    size_t Arena::objectCount() const {
+        QMutexLocker lock(&m_mutex);
+        return m_objects.size();
+    }
+
+    size_t Arena::bytes() const {
+        QMutexLocker lock(&m_mutex);
+
+        size_t total = 0;
+        for (const Chunk &chunk : m_chunks) {
+            total += chunk.size;
+        }
+
+        return total;
+    }
+
+    void Arena::release() {
+        std::vector<Chunk> chunks;
+        std::vector<std::pair<void *, void (*)(void *)>> objects;
+
+        {
+            QMutexLocker lock(&m_mutex);
+            chunks.swap(m_chunks);
+            objects.swap(m_objects);
+            m_used = 0;
+        }
+
+        for (auto it = objects.rbegin(); it != objects.rend(); ++it) {
+            it->second(it->first);
+        }
+
+        // deallocate_memory wipes the memory before freeing it.
+        for (const Chunk &chunk : chunks) {
+            Botan::deallocate_memory(chunk.data, chunk.size, 1);
+        }
+    }
+}
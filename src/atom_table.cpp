@@ -0,0 +1,79 @@
+#include "atom_table.hpp"
+
+namespace passman {
+    static const QList<QString> knownNames {"", "name", "email", "url", "notes", "password", "otp"};
+
+    AtomTable::AtomTable() {
+        for (const QString &name : knownNames) {
+            add(name, name.toUtf8());
+        }
+    }
+
+    // Callers hold the lock.
+    const Atom *AtomTable::add(const QString &t_name, const QByteArray &t_utf8) {
+        const QString folded = t_name.toCaseFolded();
+        const Atom *foldedAtom = nullptr;
+
+        if (folded != t_name) {
+            foldedAtom = m_index.value(folded, nullptr);
+            if (!foldedAtom) {
+                foldedAtom = add(folded, folded.toUtf8());
+            }
+        }
+
+        Atom &atom = m_atoms.emplace_back(Atom{static_cast<uint32_t>(m_atoms.size()), t_name, t_utf8, foldedAtom, this});
+        if (!atom.folded) {
+            atom.folded = &atom;
+        }
+
+        m_index.insert(atom.name, &atom);
+        m_utf8Index.insert(atom.utf8, &atom);
+        return &atom;
+    }
+
+    const Atom *AtomTable::intern(const QString &t_name) {
+        QMutexLocker lock(&m_mutex);
+
+        if (const Atom *atom = m_index.value(t_name, nullptr)) {
+            return atom;
+        }
+
+        return add(t_name, t_name.toUtf8());
+    }
+
+    const Atom *AtomTable::intern(const char *t_utf8, const qsizetype t_length) {
+        QMutexLocker lock(&m_mutex);
+
+        // A raw view of the bytes is enough for the lookup.
+        const QByteArray utf8 = QByteArray::fromRawData(t_utf8, t_length);
+        if (const Atom *atom = m_utf8Index.value(utf8, nullptr)) {
+            return atom;
+        }
+
+        const QByteArray owned(t_utf8, t_length);
+        return add(QString::fromUtf8(owned), owned);
+    }
+
+    qsizetype AtomTable::size() const {
+        QMutexLocker lock(&m_mutex);
+        return static_cast<qsizetype>(m_atoms.size());
+    }
+
+    void AtomTable::clear() {
+        QMutexLocker lock(&m_mutex);
+
+        m_atoms.resize(KnownCount);
+        m_index.clear();
+        m_utf8Index.clear();
+
+        for (const Atom &atom : m_atoms) {
+            m_index.insert(atom.name, &atom);
+            m_utf8Index.insert(atom.utf8, &atom);
+        }
+    }
+
+    AtomTable &AtomTable::shared() {
+        static AtomTable table;
+        return table;
+    }
+}
@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef PASSMAN_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compression.hpp"
+
+namespace passman {
+#ifdef PASSMAN_HAVE_ZSTD
+    static size_t checkZstd(const size_t t_result) {
+        if (ZSTD_isError(t_result)) {
+            throw std::runtime_error(std::string("zstd: ") + ZSTD_getErrorName(t_result));
+        }
+
+        return t_result;
+    }
+
+    /* Botan has no zstd module, so wrap libzstd's streaming API in Botan's interface. */
+    class ZstdCompression final : public Botan::Compression_Algorithm
+    {
+        std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx *)> m_ctx{ZSTD_createCCtx(), ZSTD_freeCCtx};
+
+        // Like Botan's compressors, replace buf[offset..] with its compressed form.
+        void process(secvec &t_buf, const size_t t_offset, const ZSTD_EndDirective t_mode) {
+            secvec out(t_buf.begin(), t_buf.begin() + static_cast<std::ptrdiff_t>(t_offset));
+            ZSTD_inBuffer in{t_buf.data() + t_offset, t_buf.size() - t_offset, 0};
+
+            size_t remaining = 0;
+            do {
+                const size_t pos = out.size();
+                out.resize(pos + ZSTD_CStreamOutSize());
+
+                ZSTD_outBuffer o{out.data() + pos, out.size() - pos, 0};
+                remaining = checkZstd(ZSTD_compressStream2(m_ctx.get(), &o, &in, t_mode));
+                out.resize(pos + o.pos);
+            } while (t_mode == ZSTD_e_continue ? in.pos < in.size : remaining != 0);
+
+            t_buf.swap(out);
+        }
+    public:
+        std::string name() const override {
+            return "zstd";
+        }
+
+        void clear() override {
+            ZSTD_CCtx_reset(m_ctx.get(), ZSTD_reset_session_only);
+        }
+
+        void start(size_t t_level) override {
+            ZSTD_CCtx_reset(m_ctx.get(), ZSTD_reset_session_and_parameters);
+            const int level = static_cast<int>(std::min<size_t>(t_level, static_cast<size_t>(ZSTD_maxCLevel())));
+            checkZstd(ZSTD_CCtx_setParameter(m_ctx.get(), ZSTD_c_compressionLevel, level));
+        }
+
+        void update(secvec &t_buf, size_t t_offset, bool t_flush) override {
+            process(t_buf, t_offset, t_flush ? ZSTD_e_flush : ZSTD_e_continue);
+        }
+
+        void finish(secvec &t_buf, size_t t_offset) override {
+            process(t_buf, t_offset, ZSTD_e_end);
+        }
+    };
+
+    class ZstdDecompression final : public Botan::Decompression_Algorithm
+    {
+        std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx *)> m_ctx{ZSTD_createDCtx(), ZSTD_freeDCtx};
+        bool m_frameDone = false;
+
+        void process(secvec &t_buf, const size_t t_offset) {
+            secvec out(t_buf.begin(), t_buf.begin() + static_cast<std::ptrdiff_t>(t_offset));
+            ZSTD_inBuffer in{t_buf.data() + t_offset, t_buf.size() - t_offset, 0};
+
+            // Keep going while there's input left, or while a full output buffer means more may be waiting.
+            bool full = false;
+            while (in.pos < in.size || full) {
+                const size_t pos = out.size();
+                out.resize(pos + ZSTD_DStreamOutSize());
+
+                ZSTD_outBuffer o{out.data() + pos, out.size() - pos, 0};
+                m_frameDone = checkZstd(ZSTD_decompressStream(m_ctx.get(), &o, &in)) == 0;
+                full = o.pos == o.size;
+                out.resize(pos + o.pos);
+            }
+
+            t_buf.swap(out);
+        }
+    public:
+        std::string name() const override {
+            return "zstd";
+        }
+
+        void clear() override {
+            ZSTD_DCtx_reset(m_ctx.get(), ZSTD_reset_session_only);
+            m_frameDone = false;
+        }
+
+        void start() override {
+            clear();
+        }
+
+        void update(secvec &t_buf, size_t t_offset) override {
+            process(t_buf, t_offset);
+        }
+
+        void finish(secvec &t_buf, size_t t_offset) override {
+            process(t_buf, t_offset);
+            if (!m_frameDone) {
+                throw std::runtime_error("zstd: truncated data.");
+            }
+        }
+    };
+#endif
+
+    // zstd isn't one of Botan's modules, so it's made here rather than by name.
+    static bool isZstd(const uint8_t t_compression) {
+        return Constants::compressionMatch.at(t_compression) == "zstd";
+    }
+
+    template <typename Algorithm>
+    static std::unique_ptr<Algorithm> checked(std::unique_ptr<Algorithm> t_algorithm, const uint8_t t_compression) {
+        if (!t_algorithm) {
+            throw std::runtime_error("Compression option not supported by this build: " + Constants::compressionMatch.at(t_compression));
+        }
+
+        return t_algorithm;
+    }
+
+    bool compressionAvailable(const uint8_t t_compression) {
+        if (t_compression >= Constants::compressionMatch.size()) {
+            return false;
+        }
+
+        try {
+            makeCompressor(t_compression);
+            return true;
+        } catch (std::exception &) {
+            return false;
+        }
+    }
+
+    std::unique_ptr<Botan::Compression_Algorithm> makeCompressor(const uint8_t t_compression) {
+        if (t_compression == 0) {
+            return nullptr;
+        }
+
+        if (isZstd(t_compression)) {
+#ifdef PASSMAN_HAVE_ZSTD
+            return std::make_unique<ZstdCompression>();
+#else
+            return checked<Botan::Compression_Algorithm>(nullptr, t_compression);
+#endif
+        }
+
+        // Botan returns nullptr if it was built without the module.
+        return checked(Botan::Compression_Algorithm::create(Constants::compressionMatch.at(t_compression)), t_compression);
+    }
+
+    std::unique_ptr<Botan::Decompression_Algorithm> makeDecompressor(const uint8_t t_compression) {
+        if (t_compression == 0) {
+            return nullptr;
+        }
+
+        if (isZstd(t_compression)) {
+#ifdef PASSMAN_HAVE_ZSTD
+            return std::make_unique<ZstdDecompression>();
+#else
+            return checked<Botan::Decompression_Algorithm>(nullptr, t_compression);
+#endif
+        }
+
+        return checked(Botan::Decompression_Algorithm::create(Constants::compressionMatch.at(t_compression)), t_compression);
+    }
+}
@@ -1,48 +1,103 @@
+#include <cstring>
+
 #include "data_stream.hpp"
 
 namespace passman {
-    DataStream::DataStream(const std::string &path, const std::fstream::openmode mode)
-        : stream(path, mode)
+    DataStream::DataStream(const QString &path)
+        : m_file(path)
     {
-        stream.seekp(0);
+        if (!m_file.open(QIODevice::WriteOnly)) {
+            throw std::runtime_error("Unable to open " + path.toStdString() + " for writing: " + m_file.errorString().toStdString());
+        }
+
+        m_buffer.reserve(bufferSize);
     }
 
     DataStream &DataStream::operator<<(const uint8_t val) {
-        stream.put(val);
+        put(static_cast<char>(val));
         return *this;
     }
 
     DataStream &DataStream::operator<<(const uint16_t val) {
-        stream.put(static_cast<char>(val << 8));
-        stream.put(static_cast<char>(val & 0xFF));
+        put(static_cast<char>(val >> 8));
+        put(static_cast<char>(val & 0xFF));
+        return *this;
+    }
+
+    DataStream &DataStream::operator<<(const uint32_t val) {
+        for (const int shift : {24, 16, 8, 0}) {
+            put(static_cast<char>(val >> shift));
+        }
         return *this;
     }
 
     DataStream &DataStream::operator<<(const int val) {
-        stream.put(static_cast<char>(val));
+        put(static_cast<char>(val));
         return *this;
     }
 
     DataStream &DataStream::operator<<(const bool val) {
-        stream.put(val);
+        put(val);
         return *this;
     }
 
     DataStream &DataStream::operator<<(const char *val) {
-        stream << val;
-        return *this;
+        return write(reinterpret_cast<const uint8_t *>(val), std::strlen(val));
+    }
+
+    DataStream &DataStream::operator<<(const VectorUnion &val) {
+        return write(val.data(), val.size());
     }
 
-    DataStream &DataStream::operator<<(const VectorUnion val) {
-        for (const int i : range(0, static_cast<int>(val.size()))) {
-            stream.put(secvec(val)[i]);
+    DataStream &DataStream::write(const uint8_t *t_data, const size_t t_len) {
+        const char *in = reinterpret_cast<const char *>(t_data);
+
+        if (static_cast<qsizetype>(t_len) >= bufferSize) {
+            flush();
+            writeRaw(in, static_cast<qint64>(t_len));
+        } else {
+            m_buffer.append(in, static_cast<qsizetype>(t_len));
+            if (m_buffer.size() >= bufferSize) {
+                flush();
+            }
         }
+
+        m_pos += static_cast<qint64>(t_len);
         return *this;
     }
 
-    // Flush and close the stream.
+    qint64 DataStream::pos() const {
+        return m_pos;
+    }
+
+    void DataStream::put(const char c) {
+        m_buffer.append(c);
+        ++m_pos;
+
+        if (m_buffer.size() >= bufferSize) {
+            flush();
+        }
+    }
+
+    void DataStream::flush() {
+        if (!m_buffer.isEmpty()) {
+            writeRaw(m_buffer.constData(), m_buffer.size());
+            m_buffer.clear();
+        }
+    }
+
+    void DataStream::writeRaw(const char *t_data, const qint64 t_len) {
+        if (m_file.write(t_data, t_len) != t_len) {
+            throw std::runtime_error("Unable to write " + m_file.fileName().toStdString() + ": " + m_file.errorString().toStdString());
+        }
+    }
+
+    // Flush the buffer, then sync the temporary file and rename it over the target.
     void DataStream::finish() {
-        stream.flush();
-        stream.close();
+        flush();
+
+        if (!m_file.commit()) {
+            throw std::runtime_error("Unable to save " + m_file.fileName().toStdString() + ": " + m_file.errorString().toStdString());
+        }
     }
 }
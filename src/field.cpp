@@ -1,17 +1,43 @@
 #include "field.hpp"
+#include "pdpp_entry.hpp"
+#include "pdpp_database.hpp"
 
 namespace passman {
+    Field *Field::notFound() {
+        static Field sentinel = [] {
+            Field f("", "", QMetaType::QString);
+            f.m_null = true;
+            return f;
+        }();
+
+        return &sentinel;
+    }
+
     const QString &Field::name() {
-        return m_name;
+        return this->m_name->name;
     }
 
     const QString &Field::setName(const QString &t_name) {
-        this->m_name = t_name;
+        if (this->m_null) {
+            return t_name;
+        }
+
+        this->m_name = this->m_name->table->intern(t_name);
+
+        if (this->m_entry) {
+            this->m_entry->fieldRenamed(this);
+        }
+
+        changed();
         return t_name;
     }
 
-    const QString Field::lowerName() {
-        return this->m_name.toLower();
+    const QString &Field::lowerName() {
+        return this->m_name->folded->name;
+    }
+
+    const Atom *Field::nameAtom() {
+        return this->m_name;
     }
 
     const VectorUnion &Field::data() {
@@ -19,7 +45,12 @@ namespace passman {
     }
 
     const VectorUnion &Field::setData(const VectorUnion &t_data) {
+        if (this->m_null) {
+            return t_data;
+        }
+
         this->m_data = t_data;
+        changed();
         return t_data;
     }
 
@@ -32,19 +63,83 @@ namespace passman {
     }
 
     QMetaType::Type Field::setType(const QMetaType::Type t_type) {
+        if (this->m_null) {
+            return t_type;
+        }
+
         this->m_type = t_type;
+        changed();
         return t_type;
     }
 
+    PDPPEntry *Field::entry() {
+        return this->m_entry;
+    }
+
+    PDPPEntry *Field::setEntry(PDPPEntry *t_entry) {
+        if (!this->m_null) {
+            this->m_entry = t_entry;
+        }
+
+        return t_entry;
+    }
+
+    void Field::changed() {
+        if (this->m_entry) {
+            this->m_entry->fieldChanged(this);
+        }
+    }
+
     bool Field::isName() {
-        return this->lowerName() == "name";
+        return this->m_name->folded->id == AtomTable::Name;
     }
 
     bool Field::isPass() {
-        return this->lowerName() == "password";
+        return this->m_name->folded->id == AtomTable::Password;
     }
 
     bool Field::isMultiLine() {
         return this->m_type == QMetaType::QByteArray;
     }
+
+    void Field::serialize(VectorUnion &t_out) {
+        const QByteArray &nameUtf8 = this->m_name->utf8;
+
+        appendInt(t_out, static_cast<uint32_t>(nameUtf8.size()));
+        t_out.insert(t_out.end(), nameUtf8.begin(), nameUtf8.end());
+
+        appendInt(t_out, static_cast<uint32_t>(this->m_type));
+
+        appendInt(t_out, static_cast<uint32_t>(this->m_data.size()));
+        t_out.insert(t_out.end(), this->m_data.begin(), this->m_data.end());
+    }
+
+    Field *Field::deserialize(const VectorUnion &t_in, size_t &t_pos, PDPPDatabase *t_database) {
+        const uint32_t nameLen = readInt<uint32_t>(t_in, t_pos);
+        if (t_in.size() - t_pos < nameLen) {
+            throw std::runtime_error("Unexpected end of entry data.");
+        }
+
+        // Names the table already has are found from the raw bytes, without decoding.
+        AtomTable &atoms = t_database ? t_database->atoms() : AtomTable::shared();
+        const Atom *fName = atoms.intern(t_in.asConstChar() + t_pos, static_cast<qsizetype>(nameLen));
+        t_pos += nameLen;
+
+        const QMetaType::Type fType = static_cast<QMetaType::Type>(readInt<uint32_t>(t_in, t_pos));
+
+        const uint32_t dataLen = readInt<uint32_t>(t_in, t_pos);
+        if (t_in.size() - t_pos < dataLen) {
+            throw std::runtime_error("Unexpected end of entry data.");
+        }
+
+        VectorUnion fData;
+        fData.assign(t_in.begin() + static_cast<std::ptrdiff_t>(t_pos), t_in.begin() + static_cast<std::ptrdiff_t>(t_pos + dataLen));
+        t_pos += dataLen;
+
+        if (t_database) {
+            return t_database->arena().make<Field>(fName, fData, fType);
+        }
+
+        return new Field(fName, fData, fType);
+    }
 }
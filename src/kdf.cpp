@@ -1,24 +1,126 @@
+#include <botan/auto_rng.h>
 #include <botan/compression.h>
+#include <botan/cpuid.h>
 #include <botan/hex.h>
+#include <botan/version.h>
 #include <QElapsedTimer>
 #include <QFile>
 #include <QVariant>
 
+#include <algorithm>
+
 #include "kdf.hpp"
 
 namespace passman {
+    struct CipherInfo {
+        size_t nonceLength;
+        size_t keyLength;
+    };
+
+    // Nonce and key lengths only depend on the encryption option, so each cipher is only built once to find them.
+    static const CipherInfo &cipherInfo(uint8_t t_encryptionFunction) {
+        static const QList<CipherInfo> infos = [] {
+            QList<CipherInfo> list;
+            for (const std::string &name : Constants::encryptionMatch) {
+                auto mode = Botan::Cipher_Mode::create(name, Botan::ENCRYPTION);
+                list.emplaceBack(CipherInfo{mode->default_nonce_length(), mode->maximum_keylength()});
+            }
+
+            return list;
+        }();
+
+        return infos.at(t_encryptionFunction);
+    }
+
+    size_t KDF::nonceLength(uint8_t t_encryptionFunction) {
+        return cipherInfo(t_encryptionFunction).nonceLength;
+    }
+
+    size_t KDF::keyLength(uint8_t t_encryptionFunction) {
+        return cipherInfo(t_encryptionFunction).keyLength;
+    }
+
+    QStringList KDF::cpuFeatures() {
+        return QString::fromStdString(Botan::CPUID::to_string()).split(' ', Qt::SkipEmptyParts);
+    }
+
+    bool KDF::hasHardwareAes() {
+        return Botan::CPUID::has_hw_aes();
+    }
+
+    bool KDF::isTimingSafe(const uint8_t t_encryptionFunction) {
+        switch (t_encryptionFunction) {
+            case 0: {
+                // Since 2.14, Botan's software AES is bitsliced or vperm based, with no key-dependent table lookups.
+    #if BOTAN_VERSION_CODE >= BOTAN_VERSION_CODE_FOR(2, 14, 0)
+                return true;
+    #else
+                return hasHardwareAes();
+    #endif
+            } case 1: {
+                // Twofish's key-dependent S-boxes are table lookups on every backend.
+                return false;
+            } default: {
+                // SHACAL2, Serpent and ChaCha20 don't index tables by secret data.
+                return t_encryptionFunction < Constants::encryptionMatch.size();
+            }
+        }
+    }
+
+    double KDF::throughput(const uint8_t t_encryptionFunction, const int t_msec) {
+        Botan::AutoSeeded_RNG rng;
+        auto enc = Botan::Cipher_Mode::create(Constants::encryptionMatch.at(t_encryptionFunction), Botan::ENCRYPTION);
+        enc->set_key(rng.random_vec(enc->maximum_keylength()));
+
+        // The key is thrown away, so reusing the nonce gives nothing away.
+        const secvec nonce = rng.random_vec(enc->default_nonce_length());
+        secvec buf(Constants::streamChunkSize);
+        uint64_t bytes = 0;
+
+        QElapsedTimer timer;
+        timer.start();
+        do {
+            buf.resize(Constants::streamChunkSize);
+            enc->start(nonce);
+            enc->finish(buf);
+            bytes += Constants::streamChunkSize;
+        } while (timer.elapsed() < t_msec);
+
+        return static_cast<double>(bytes) / static_cast<double>(std::max<qint64>(timer.nsecsElapsed(), 1)) * 1e3;
+    }
+
+    uint8_t KDF::recommendEncryption(const int t_msec) {
+        // ChaCha20-Poly1305 is always timing safe, so it's the fallback.
+        uint8_t best = 4;
+        double bestSpeed = 0;
+
+        for (uint8_t i = 0; i < Constants::encryptionMatch.size(); ++i) {
+            if (!isTimingSafe(i)) {
+                continue;
+            }
+
+            const double speed = throughput(i, t_msec);
+            if (speed > bestSpeed) {
+                best = i;
+                bestSpeed = speed;
+            }
+        }
+
+        return best;
+    }
+
     KDF::KDF(const QVariantMap &p) {
         setParams(p);
     }
 
     bool KDF::setParams(const QVariantMap &p) {
-        uint16_t i1 = static_cast<uint16_t>(p.value("i1", 0).toUInt());
+        uint32_t i1 = p.value("i1", 0).toUInt();
         setI1(i1);
 
-        uint16_t i2 = static_cast<uint16_t>(p.value("i2", 0).toUInt());
+        uint32_t i2 = p.value("i2", 0).toUInt();
         setI2(i2);
 
-        uint16_t i3 = static_cast<uint16_t>(p.value("i3", 0).toUInt());
+        uint32_t i3 = p.value("i3", 0).toUInt();
         setI3(i3);
 
         uint8_t hmac = static_cast<uint8_t>(p.value("hmac", 0).toUInt());
@@ -49,31 +151,34 @@ namespace passman {
         return true;
     }
 
-    uint16_t KDF::i1() {
+    uint32_t KDF::i1() {
         return m_i1;
     }
 
-    void KDF::setI1(uint16_t t_i1) {
+    void KDF::setI1(uint32_t t_i1) {
         m_i1 = t_i1;
+        m_hasher.reset();
     }
 
-    uint16_t KDF::i2() {
+    uint32_t KDF::i2() {
         return m_i2;
     }
 
-    void KDF::setI2(uint16_t t_i2) {
+    void KDF::setI2(uint32_t t_i2) {
         m_i2 = t_i2;
+        m_hasher.reset();
     }
 
-    uint16_t KDF::i3() {
+    uint32_t KDF::i3() {
         return m_i3;
     }
 
-    void KDF::setI3(uint16_t t_i3) {
+    void KDF::setI3(uint32_t t_i3) {
         m_i3 = t_i3;
+        m_hasher.reset();
     }
 
-    uint16_t KDF::rounds() {
+    uint32_t KDF::rounds() {
         switch (hashFunction()) {
             case 1: {
                 return i1();
@@ -83,20 +188,28 @@ namespace passman {
         }
     }
 
-    uint16_t KDF::memoryUsage() {
+    uint32_t KDF::memoryUsage() {
         switch (hashFunction()) {
             case 0: {
                 return i1();
             } case 2: {
-                return static_cast<uint16_t>(128 * i1() * i2());
+                // Scrypt uses 128 * N * r bytes.
+                return static_cast<uint32_t>(128 * static_cast<uint64_t>(i1()) * i2() / 1024);
             } default: {
                 return 0;
             }
         }
     }
 
-    uint16_t KDF::parallelism() {
-        return i3();
+    uint32_t KDF::parallelism() {
+        switch (hashFunction()) {
+            case 0:
+            case 2: {
+                return std::max<uint32_t>(i3(), 1);
+            } default: {
+                return 1;
+            }
+        }
     }
 
     uint8_t KDF::hmacFunction() {
@@ -122,6 +235,7 @@ namespace passman {
         }
 
         m_hashFunction = t_hashFunction;
+        m_hasher.reset();
         return true;
     }
 
@@ -144,8 +258,7 @@ namespace passman {
     }
 
     bool KDF::setSeed(VectorUnion t_seed) {
-        auto encryptor = makeEncryptor();
-        if (encryptor->default_nonce_length() != t_seed.size()) {
+        if (nonceLength(encryptionFunction()) != t_seed.size()) {
             return false;
         }
 
@@ -198,11 +311,10 @@ namespace passman {
             t_hmacFunction = hmacFunction();
         }
 
-        auto enc = makeEncryptor();
         std::string hmacChoice(Constants::hmacMatch[t_hmacFunction]);
 
         if (hmacChoice != "SHA-512") {
-            hmacChoice += '(' + std::to_string(enc->maximum_keylength() * 8) + ')';
+            hmacChoice += '(' + std::to_string(keyLength(encryptionFunction()) * 8) + ')';
         }
 
         return Botan::PasswordHashFamily::create("PBKDF2(" + hmacChoice + ')')->default_params();
@@ -217,18 +329,27 @@ namespace passman {
         return h;
     }
 
+    const Botan::PasswordHash &KDF::hasher() {
+        QMutexLocker lock(&m_hasherMutex);
+        if (!m_hasher) {
+            m_hasher = makeHasher();
+        }
+
+        return *m_hasher;
+    }
+
 
     VectorUnion KDF::transform(VectorUnion t_data, VectorUnion t_seed) {
         if (t_seed.empty()) {
             t_seed = seed();
         }
 
-        auto enc = makeEncryptor();
+        const size_t seedLength = nonceLength(encryptionFunction());
         if (hashFunction() < 3) {
             secvec ptr(512);
-            auto hash = makeHasher();
 
-            hash->derive_key(ptr.data(), ptr.size(), t_data.asConstChar(), t_data.size(), t_seed.data(), enc->default_nonce_length());
+            // Argon2id, Bcrypt-PBKDF and Scrypt keep no state between derivations, so the cached hasher can be shared.
+            hasher().derive_key(ptr.data(), ptr.size(), t_data.asConstChar(), t_data.size(), t_seed.data(), seedLength);
 
     #ifdef DEBUG
             qDebug() << t_data;
@@ -236,10 +357,10 @@ namespace passman {
     #endif
         }
 
-        secvec ptr(enc->maximum_keylength());
+        secvec ptr(keyLength(encryptionFunction()));
         auto deriv = makeDerivation();
 
-        deriv->derive_key(ptr.data(), ptr.size(), t_data.asConstChar(), t_data.size(), t_seed.data(), enc->default_nonce_length());
+        deriv->derive_key(ptr.data(), ptr.size(), t_data.asConstChar(), t_data.size(), t_seed.data(), seedLength);
 
     #ifdef DEBUG
         qDebug() << toString() << t_seed << t_data;
@@ -249,15 +370,30 @@ namespace passman {
         return ptr;
     }
 
-    int KDF::benchmark(const int t_msec) {
-        QByteArray key = QByteArray(16, '\x50');
-        QByteArray seed = QByteArray(32, '\x2B');
+    double KDF::measure(const int t_samples) {
+        const VectorUnion key = QByteArray(16, '\x50');
+        // At least as long as any encryption option's nonce.
+        const VectorUnion seed = QByteArray(64, '\x2B');
 
+        QList<double> times;
         QElapsedTimer timer;
-        timer.start();
 
-        if (transform(key, seed)) {
-            return static_cast<int>(rounds() * (static_cast<float>(t_msec) / static_cast<float>(timer.elapsed())));
+        for (int i = 0; i < std::max(t_samples, 1); ++i) {
+            timer.start();
+            transform(key, seed);
+            times.emplaceBack(static_cast<double>(timer.nsecsElapsed()) / 1e6);
+        }
+
+        // The median shrugs off the odd run slowed down by the scheduler or page faults.
+        std::sort(times.begin(), times.end());
+        return times[times.size() / 2];
+    }
+
+    int KDF::benchmark(const int t_msec) {
+        const double elapsed = measure();
+
+        if (elapsed > 0) {
+            return std::max(1, static_cast<int>(rounds() * (t_msec / elapsed)));
         }
 
         return 1;
@@ -268,8 +404,10 @@ namespace passman {
         QString hmac = tr(Constants::hmacMatch.at(hmacFunction()));
         QString encryption = tr(Constants::encryptionMatch.at(encryptionFunction()));
 
-        uint16_t hrounds = rounds();
-        uint16_t mem = memoryUsage();
-        return tr(hash + ", using " + hmac + " and " + encryption + " (" + QString::number(hrounds) + " rounds, " + QString::number(mem / 1000) + " MB, 1 thread)");
+        uint32_t hrounds = rounds();
+        uint32_t mem = memoryUsage();
+        uint32_t threads = parallelism();
+        return tr(hash + ", using " + hmac + " and " + encryption + " (" + QString::number(hrounds) + " rounds, " + QString::number(mem / 1000) + " MB, "
+                  + QString::number(threads) + (threads == 1 ? " thread)" : " threads)"));
     }
 }
@@ -2,18 +2,220 @@
 #include <QSqlQuery>
 #include <QSqlField>
 #include <QSqlError>
+#include <QSqlDriver>
+#include <QSet>
 #include <QFile>
 #include <QFileInfo>
+#include <QPromise>
+#include <QSemaphore>
+#include <QThreadPool>
+
+#include <algorithm>
+#include <cstring>
+#include <future>
+
+#include <botan/aead.h>
+#include <botan/auto_rng.h>
 
 #include "pdpp_database.hpp"
 #include "pdpp_entry.hpp"
 #include "data_stream.hpp"
+#include "stream_cipher.hpp"
+#include "compression.hpp"
 
 namespace passman {
+    // Encrypts t_buf in place under a fresh random nonce, then under the key file key if given, and prepends the nonce.
+    static void sealBlock(Botan::Cipher_Mode &t_enc, Botan::Cipher_Mode *t_keyEnc, Botan::RandomNumberGenerator &t_rng, const secvec &t_ad, VectorUnion &t_buf) {
+        const secvec nonce = t_rng.random_vec(t_enc.default_nonce_length());
+
+        for (Botan::Cipher_Mode *mode : {&t_enc, t_keyEnc}) {
+            if (!mode) {
+                continue;
+            }
+
+            if (auto aead = dynamic_cast<Botan::AEAD_Mode *>(mode)) {
+                aead->set_associated_data(t_ad.data(), t_ad.size());
+            }
+
+            mode->start(nonce);
+            mode->finish(t_buf);
+        }
+
+        t_buf.insert(t_buf.begin(), nonce.begin(), nonce.end());
+    }
+
+    // Whether a complete entry record (see Field::serialize) starts at t_pos, checked without decoding it.
+    static bool recordComplete(const secvec &t_in, size_t t_pos) {
+        auto skip = [&t_in, &t_pos](const size_t t_len) {
+            if (t_in.size() - t_pos < t_len) {
+                return false;
+            }
+
+            t_pos += t_len;
+            return true;
+        };
+
+        if (t_in.size() - t_pos < 4) {
+            return false;
+        }
+
+        const uint32_t fields = readInt<uint32_t>(t_in, t_pos);
+        for (uint32_t i = 0; i < fields; ++i) {
+            if (t_in.size() - t_pos < 4) {
+                return false;
+            }
+
+            if (!skip(readInt<uint32_t>(t_in, t_pos)) || t_in.size() - t_pos < 8) {
+                return false;
+            }
+
+            t_pos += 4;
+            if (!skip(readInt<uint32_t>(t_in, t_pos))) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Reverses sealBlock. Returns 3 if the key file layer fails, 0 if the password layer fails, and 1 on success.
+    static int openBlock(Botan::Cipher_Mode &t_dec, Botan::Cipher_Mode *t_keyDec, const secvec &t_ad, const uint8_t *t_in, const size_t t_len, VectorUnion &t_out) {
+        const size_t nonceLen = t_dec.default_nonce_length();
+        if (t_len < nonceLen) {
+            return 0;
+        }
+
+        t_out.assign(t_in + nonceLen, t_in + t_len);
+
+        for (Botan::Cipher_Mode *mode : {t_keyDec, &t_dec}) {
+            if (!mode) {
+                continue;
+            }
+
+            if (auto aead = dynamic_cast<Botan::AEAD_Mode *>(mode)) {
+                aead->set_associated_data(t_ad.data(), t_ad.size());
+            }
+
+            try {
+                mode->start(t_in, nonceLen);
+                mode->finish(t_out);
+            } catch (std::exception &e) {
+                std::cerr << e.what() << std::endl;
+                return mode == t_keyDec ? 3 : 0;
+            }
+        }
+
+        return 1;
+    }
+
+    // Gives the entries made while reloading an arena of their own. Once the database holds the new entries, commit() lets the guard
+    // release the old arena with them; if the reload fails, the new arena is released instead and the old entries are kept.
+    class ArenaReload
+    {
+        std::unique_ptr<Arena> &m_arena;
+        std::unique_ptr<Arena> m_other;
+        bool m_committed = false;
+    public:
+        explicit ArenaReload(PDPPDatabase *t_database)
+            : m_arena(t_database->m_arena)
+            , m_other(std::exchange(t_database->m_arena, std::make_unique<Arena>()))
+        {}
+
+        ~ArenaReload() {
+            if (!m_committed) {
+                m_arena.swap(m_other);
+            }
+        }
+
+        void commit() {
+            m_committed = true;
+        }
+    };
+
     PDPPDatabase::PDPPDatabase(const QVariantMap &p) {
         setParams(p);
     }
 
+    PDPPDatabase::~PDPPDatabase() {
+        waitForTasks();
+    }
+
+    void PDPPDatabase::waitForTasks() {
+        for (QFuture<void> &task : m_tasks) {
+            task.waitForFinished();
+        }
+
+        m_tasks.clear();
+    }
+
+    void PDPPDatabase::close() {
+        waitForTasks();
+        discard();
+    }
+
+    void PDPPDatabase::discard() {
+        m_entries.clear();
+        m_nameIndex.clear();
+        m_shadowedNames = 0;
+        m_passwordIndex.clear();
+        m_passwordDigests.clear();
+        m_passwordIndexValid = false;
+        m_passwordMac.reset();
+        m_searchIndex.clear();
+        m_searchIndexValid = false;
+        m_blocks.clear();
+        m_pendingBlocks.clear();
+
+        m_arena->release();
+        // Nothing points into the table once the arena is gone.
+        m_atoms.clear();
+
+        unmap();
+        m_streamHead.reset();
+        m_enc = {};
+        m_keyEnc = {};
+        m_dec = {};
+        m_keyDec = {};
+        m_blockDec = {};
+        m_blockKeyDec = {};
+
+        // Secure vectors are wiped as they're freed.
+        passw = {};
+        m_keyFileKey = {};
+        m_sealKey = {};
+        m_sealKeyFileKey = {};
+        stList = {};
+        data = {};
+
+        modified = false;
+    }
+
+    PDPPEntry *PDPPDatabase::makeEntry(QList<Field *> t_fields) {
+        // Default fields are made here, so they live in the arena along with the entry.
+        return m_arena->make<PDPPEntry>(t_fields.isEmpty() ? PDPPEntry::defaultFields(this) : t_fields, this);
+    }
+
+    Field *PDPPDatabase::makeField(const QString &t_name, const VectorUnion &t_data, const QMetaType::Type t_type) {
+        return m_arena->make<Field>(m_atoms.intern(t_name), t_data, t_type);
+    }
+
+    void PDPPDatabase::reloaded(const QList<PDPPEntry *> &t_entries, const QHash<PDPPEntry *, EntryBlock> &t_blocks) {
+        // Keys of the old blocks would dangle once the old arena is released.
+        m_blocks = t_blocks;
+        setEntries(t_entries);
+
+        if (searchIndex) {
+            buildSearchIndex();
+        }
+    }
+
+    void PDPPDatabase::trackTask(const QFuture<void> &t_task) {
+        m_tasks.removeIf([](const QFuture<void> &task) {
+            return task.isFinished();
+        });
+        m_tasks.emplaceBack(t_task);
+    }
+
     bool PDPPDatabase::setParams(const QVariantMap &p) {
         uint8_t t_hmac = static_cast<uint8_t>(p.value("hmac", 0).toUInt());
         hmac = t_hmac;
@@ -30,12 +232,25 @@ namespace passman {
         uint8_t t_version = static_cast<uint8_t>(p.value("version", Constants::maxVersion).toUInt());
         version = t_version;
 
-        uint16_t t_memoryUsage = static_cast<uint16_t>(p.value("memory", 64).toUInt());
+        uint32_t t_memoryUsage = p.value("memory", 64).toUInt();
         memoryUsage = t_memoryUsage;
+        m_memoryCost = 0;
+
+        uint8_t t_parallelism = static_cast<uint8_t>(p.value("parallelism", 1).toUInt());
+        parallelism = std::max<uint8_t>(t_parallelism, 1);
 
         uint8_t t_clearSecs = static_cast<uint8_t>(p.value("clearsecs", 15).toUInt());
         clearSecs = t_clearSecs;
 
+        uint8_t t_compress = static_cast<uint8_t>(p.value("compression", 1).toUInt());
+        compress = t_compress;
+
+        uint8_t t_compressionLevel = static_cast<uint8_t>(p.value("compressionlevel", 0).toUInt());
+        compressionLevel = t_compressionLevel;
+
+        uint8_t t_layout = static_cast<uint8_t>(p.value("layout", SinglePayload).toUInt());
+        layout = t_layout;
+
         VectorUnion t_iv = p.value("iv", {}).toByteArray();
         iv = t_iv;
         ivLen = t_iv.size();
@@ -56,90 +271,750 @@ namespace passman {
         return true;
     }
 
+    void PDPPDatabase::addEntry(PDPPEntry *entry) {
+        this->m_entries.emplaceBack(entry);
+        indexEntry(entry);
+
+        if (m_passwordIndexValid) {
+            indexPassword(entry);
+        }
+
+        if (m_searchIndexValid) {
+            m_searchIndex.addEntry(entry);
+        }
+
+        this->modified = true;
+    }
+
+    bool PDPPDatabase::removeEntry(PDPPEntry *entry) {
+        bool ok = this->m_entries.removeOne(entry);
+        if (ok) {
+            unindexEntry(entry, entry->name());
+            unindexPassword(entry);
+            m_searchIndex.removeEntry(entry);
+            m_blocks.remove(entry);
+        }
+
+        this->modified = ok;
+        return ok;
+    }
+
+    void PDPPDatabase::setEntries(QList<PDPPEntry *> t_entries) {
+        this->m_entries = t_entries;
+        rebuildIndex();
+
+        // The password index is rebuilt lazily, on the next lookup.
+        m_passwordIndex.clear();
+        m_passwordDigests.clear();
+        m_passwordIndexValid = false;
+
+        // So is the search index, unless searchIndex asks for it up front.
+        m_searchIndex.clear();
+        m_searchIndexValid = false;
+
+        this->modified = true;
+    }
+
+    // Entries whose name is already taken stay out of the index, but are counted so a later removal can promote them.
+    void PDPPDatabase::indexEntry(PDPPEntry *t_entry) {
+        if (m_nameIndex.contains(t_entry->name())) {
+            ++m_shadowedNames;
+        } else {
+            m_nameIndex.insert(t_entry->name(), t_entry);
+        }
+    }
+
+    void PDPPDatabase::unindexEntry(PDPPEntry *t_entry, const QString &t_name) {
+        auto it = m_nameIndex.find(t_name);
+        if (it == m_nameIndex.end() || it.value() != t_entry) {
+            --m_shadowedNames;
+            return;
+        }
+
+        m_nameIndex.erase(it);
+
+        // Only scan when another entry may share this name, so the common case stays O(1).
+        if (m_shadowedNames > 0) {
+            for (PDPPEntry *e : m_entries) {
+                if (e != t_entry && e->name() == t_name) {
+                    m_nameIndex.insert(t_name, e);
+                    --m_shadowedNames;
+                    break;
+                }
+            }
+        }
+    }
+
+    void PDPPDatabase::rebuildIndex() {
+        m_nameIndex.clear();
+        m_nameIndex.reserve(m_entries.size());
+        m_shadowedNames = 0;
+
+        for (PDPPEntry *e : m_entries) {
+            indexEntry(e);
+        }
+    }
+
+    void PDPPDatabase::renameEntry(PDPPEntry *t_entry, const QString &t_oldName) {
+        if (m_nameIndex.value(t_oldName) == t_entry) {
+            unindexEntry(t_entry, t_oldName);
+        } else if (m_shadowedNames > 0 && m_entries.contains(t_entry)) {
+            --m_shadowedNames;
+        } else {
+            // Not part of this database (yet); addEntry() will index it.
+            return;
+        }
+
+        // entryNamed() returns the first entry with a name, so an earlier entry renamed onto a taken name takes it over.
+        auto it = m_nameIndex.find(t_entry->name());
+        if (it != m_nameIndex.end() && m_entries.indexOf(t_entry) < m_entries.indexOf(it.value())) {
+            it.value() = t_entry;
+            ++m_shadowedNames;
+            return;
+        }
+
+        indexEntry(t_entry);
+    }
+
     PDPPEntry *PDPPDatabase::entryNamed(const QString &t_name) {
+        return m_nameIndex.value(t_name, nullptr);
+    }
+
+    QByteArray PDPPDatabase::passwordDigest(const VectorUnion &t_pass) {
+        if (!m_passwordMac) {
+            Botan::AutoSeeded_RNG rng;
+
+            m_passwordMac = Botan::MessageAuthenticationCode::create_or_throw("HMAC(SHA-256)");
+            m_passwordMac->set_key(rng.random_vec(32));
+        }
+
+        m_passwordMac->update(t_pass);
+        const secvec digest = m_passwordMac->final();
+
+        return QByteArray(reinterpret_cast<const char *>(digest.data()), static_cast<qsizetype>(digest.size()));
+    }
+
+    // Entries without a password field are indexed under the empty password, matching the old linear scan.
+    void PDPPDatabase::indexPassword(PDPPEntry *t_entry) {
+        // Field::notFound() is empty, so entries without one get the empty password.
+        const QByteArray digest = passwordDigest(t_entry->fieldNamed(QStringLiteral("password"))->data());
+        m_passwordIndex[digest].emplaceBack(t_entry);
+        m_passwordDigests.insert(t_entry, digest);
+    }
+
+    void PDPPDatabase::unindexPassword(PDPPEntry *t_entry) {
+        auto it = m_passwordDigests.find(t_entry);
+        if (it == m_passwordDigests.end()) {
+            return;
+        }
+
+        auto bucket = m_passwordIndex.find(it.value());
+        bucket.value().removeOne(t_entry);
+        if (bucket.value().isEmpty()) {
+            m_passwordIndex.erase(bucket);
+        }
+
+        m_passwordDigests.erase(it);
+    }
+
+    void PDPPDatabase::buildPasswordIndex() {
+        m_passwordIndex.clear();
+        m_passwordDigests.clear();
+        m_passwordDigests.reserve(m_entries.size());
+
         for (PDPPEntry *e : m_entries) {
-            if (e->name() == t_name) {
-                return e;
+            indexPassword(e);
+        }
+
+        m_passwordIndexValid = true;
+    }
+
+    void PDPPDatabase::entryChanged(PDPPEntry *t_entry, Field *t_field) {
+        Q_UNUSED(t_field)
+
+        this->modified = true;
+
+        // Only entries already in the index belong to this database.
+        if (m_passwordIndexValid && m_passwordDigests.contains(t_entry)) {
+            const QByteArray digest = passwordDigest(t_entry->fieldNamed(QStringLiteral("password"))->data());
+
+            // Entries whose password didn't change keep their place in its bucket.
+            if (digest != m_passwordDigests.value(t_entry)) {
+                unindexPassword(t_entry);
+
+                // entryWithPassword() returns the first entry in list order, so the entry goes where it is in the list, not at the end.
+                QList<PDPPEntry *> &bucket = m_passwordIndex[digest];
+                const qsizetype position = m_entries.indexOf(t_entry);
+                auto it = std::lower_bound(bucket.begin(), bucket.end(), position, [this](PDPPEntry *t_other, const qsizetype t_position) {
+                    return m_entries.indexOf(t_other) < t_position;
+                });
+
+                bucket.insert(it, t_entry);
+                m_passwordDigests.insert(t_entry, digest);
             }
         }
 
-        return nullptr;
+        if (m_searchIndexValid && m_searchIndex.contains(t_entry)) {
+            m_searchIndex.updateField(t_entry, t_field);
+        }
     }
 
     PDPPEntry *PDPPDatabase::entryWithPassword(const QString &t_pass) {
-        for (PDPPEntry *e : m_entries) {
-            if (e->fieldNamed("password")->dataStr() == t_pass) {
-                return e;
+        if (!m_passwordIndexValid) {
+            buildPasswordIndex();
+        }
+
+        const QList<PDPPEntry *> matches = m_passwordIndex.value(passwordDigest(t_pass));
+        return matches.isEmpty() ? nullptr : matches.first();
+    }
+
+    QList<QList<PDPPEntry *>> PDPPDatabase::reusedPasswords() {
+        if (!m_passwordIndexValid) {
+            buildPasswordIndex();
+        }
+
+        const QByteArray empty = passwordDigest(VectorUnion{});
+        QList<QList<PDPPEntry *>> groups;
+
+        for (auto it = m_passwordIndex.cbegin(); it != m_passwordIndex.cend(); ++it) {
+            if (it.value().size() > 1 && it.key() != empty) {
+                groups.emplaceBack(it.value());
             }
         }
 
-        return nullptr;
+        return groups;
+    }
+
+    void PDPPDatabase::buildSearchIndex() {
+        m_searchIndex.build(m_entries);
+        m_searchIndexValid = true;
+    }
+
+    QList<SearchHit> PDPPDatabase::search(const QString &t_query) {
+        if (!m_searchIndexValid) {
+            buildSearchIndex();
+        }
+
+        return m_searchIndex.search(t_query);
     }
 
     void PDPPDatabase::get() {
-        setEntries({});
+        // Checked once here rather than per table, since it reads the file from disk.
+        m_oldFormat = isOld();
 
+        ArenaReload reload(this);
+        QList<PDPPEntry *> stubs;
         for (const QString &tbl : db.tables()) {
-            QSqlQuery q(db);
-            q.exec("SELECT * FROM " + tbl);
-            q.next();
-            QList<Field *> fields;
-            QSqlRecord rec = q.record();
+            stubs.emplaceBack(PDPPEntry::stub(tbl, this));
+        }
+
+        reloaded(stubs);
+        reload.commit();
+    }
+
+    QList<Field *> PDPPDatabase::loadFields(PDPPEntry *t_entry) {
+        auto block = m_blocks.find(t_entry);
+        if (block != m_blocks.end()) {
+            // Entries are loaded one at a time, so the keyed decryptors are kept rather than scheduling the keys for every block.
+            // Blocks stay sealed under the keys and cipher of the last save, whatever the settings have been changed to since.
+            Botan::Cipher_Mode &dec = cipher(m_blockDec, Botan::DECRYPTION, m_sealKey, m_sealEncryption);
+            Botan::Cipher_Mode *keyDec = m_sealKeyFile ? &cipher(m_blockKeyDec, Botan::DECRYPTION, m_sealKeyFileKey, m_sealEncryption) : nullptr;
+
+            const QByteArray nameUtf8 = t_entry->name().toUtf8();
+            const secvec ad(nameUtf8.begin(), nameUtf8.end());
+
+            VectorUnion record;
+            const uint8_t *in = cipherText().data() + m_blocksOffset + block.value().offset;
+            const QByteArray &nonce = block.value().nonce;
+            if (block.value().length < static_cast<size_t>(nonce.size()) || std::memcmp(in, nonce.constData(), static_cast<size_t>(nonce.size())) != 0) {
+                throw std::runtime_error("Entry block doesn't match the block table: " + t_entry->name().toStdString());
+            }
+
+            if (openBlock(dec, keyDec, ad, in, block.value().length, record) != 1) {
+                throw std::runtime_error("Entry block failed to decrypt: " + t_entry->name().toStdString());
+            }
+
+            size_t pos = 0;
+            QList<Field *> fields = PDPPEntry::deserializeFields(record, pos, this);
+
+            // The block is still valid under the keys it was opened with, so an untouched entry reuses it on the next save.
+            VectorUnion sealed;
+            sealed.assign(in, in + block.value().length);
+            t_entry->setCachedRecord(std::move(record), std::move(sealed));
+            m_blocks.erase(block);
+
+            return fields;
+        }
+
+        return readTable(db, t_entry->name());
+    }
+
+    QList<Field *> PDPPDatabase::readTable(const QSqlDatabase &t_sql, const QString &t_table) {
+        QSqlQuery q(t_sql);
+        q.exec("SELECT * FROM " + t_sql.driver()->escapeIdentifier(t_table, QSqlDriver::TableName));
+        q.next();
+        QList<Field *> fields;
+        QSqlRecord rec = q.record();
     #ifdef DEBUG
-            qDebug() << "generating entry from table" << tbl;
-            qDebug() << rec;
+        qDebug() << "generating entry from table" << t_table;
+        qDebug() << rec;
     #endif
 
-            for (const int i : range(0, rec.count())) {
-                QString vName = rec.fieldName(i);
-                const QString val = rec.value(i).toString().replace(" || char(10) || ", "\n");
-                QMetaType::Type id = static_cast<QMetaType::Type>(rec.field(i).metaType().id());
+        for (const int i : range(0, rec.count())) {
+            QString vName = rec.fieldName(i);
+            const QString val = rec.value(i).toString().replace(" || char(10) || ", "\n");
+            QMetaType::Type id = static_cast<QMetaType::Type>(rec.field(i).metaType().id());
 
-                if (isOld()) {
-                    vName.replace(0, 1, vName[0].toUpper());
-                    if (vName.toLower() == "notes") {
-                        id = QMetaType::QByteArray;
-                    }
+            if (m_oldFormat) {
+                vName.replace(0, 1, vName[0].toUpper());
+                if (vName.toLower() == "notes") {
+                    id = QMetaType::QByteArray;
+                }
+            }
+            fields.emplaceBack(makeField(vName, val, id));
+        }
+
+        return fields;
+    }
+
+    VectorUnion PDPPDatabase::serializeEntries() {
+        // Unnamed entries are skipped, just like saveSt() does.
+        uint32_t count = 0;
+        for (PDPPEntry *entry : m_entries) {
+            if (!entry->name().isEmpty()) {
+                ++count;
+            }
+        }
+
+        VectorUnion payload;
+        appendInt(payload, count);
+
+        for (PDPPEntry *entry : m_entries) {
+            if (!entry->name().isEmpty()) {
+                entry->serialize(payload);
+            }
+        }
+
+        return payload;
+    }
+
+    void PDPPDatabase::loadEntries(const VectorUnion &t_payload) {
+        size_t pos = 0;
+        const uint32_t count = readInt<uint32_t>(t_payload, pos);
+
+        ArenaReload reload(this);
+        QList<PDPPEntry *> loaded;
+
+        for (uint32_t i = 0; i < count; ++i) {
+            loaded.emplaceBack(PDPPEntry::deserialize(t_payload, pos, this));
+        }
+
+        if (pos != t_payload.size()) {
+            throw std::runtime_error("Trailing data after entry records.");
+        }
+
+        reloaded(loaded);
+        reload.commit();
+    }
+
+    void PDPPDatabase::sealStream(const VectorUnion &t_keyFileKey, const std::function<void(const secvec &)> &t_sink) {
+        Botan::Cipher_Mode &enc = cipher(m_enc, Botan::ENCRYPTION, passw);
+        Botan::Cipher_Mode *keyEnc = keyFile ? &cipher(m_keyEnc, Botan::ENCRYPTION, t_keyFileKey) : nullptr;
+
+        Botan::AutoSeeded_RNG rng;
+        StreamEncryptor stream(enc, keyEnc, rng, t_sink);
+
+        std::unique_ptr<Botan::Compression_Algorithm> comp = makeCompressor(compress);
+        if (comp) {
+            comp->start(compressionLevel);
+        }
+
+        // Same plaintext as serializeEntries(), but fed through one record at a time.
+        auto put = [&comp, &stream](secvec &t_buf) {
+            if (comp) {
+                comp->update(t_buf);
+            }
+
+            stream.update(t_buf.data(), t_buf.size());
+        };
+
+        uint32_t count = 0;
+        for (PDPPEntry *entry : m_entries) {
+            if (!entry->name().isEmpty()) {
+                ++count;
+            }
+        }
+
+        secvec buf;
+        appendInt(buf, count);
+        put(buf);
+
+        for (PDPPEntry *entry : m_entries) {
+            if (!entry->name().isEmpty()) {
+                const VectorUnion &record = entry->record();
+                buf.assign(record.begin(), record.end());
+                put(buf);
+            }
+        }
+
+        buf.clear();
+        if (comp) {
+            comp->finish(buf);
+        }
+
+        stream.update(buf.data(), buf.size());
+        stream.finish();
+    }
+
+    int PDPPDatabase::decryptStream(const VectorUnion &t_key, const VectorUnion &t_keyFileKey, const bool t_load) {
+        // Streamed data isn't kept in memory after saving, so it may need mapping again.
+        if (!m_mapFile) {
+            m_mapped = mapFile().mid(m_dataOffset);
+        }
+
+        const ByteView in = m_mapped;
+
+        Botan::Cipher_Mode &dec = cipher(m_dec, Botan::DECRYPTION, t_key);
+        Botan::Cipher_Mode *keyDec = keyFile ? &cipher(m_keyDec, Botan::DECRYPTION, t_keyFileKey) : nullptr;
+
+        if (!t_load) {
+            // Authenticating the first chunk is enough to know the keys are right. It's kept, so loading starts after it.
+            m_streamHead.reset();
+
+            size_t pos = dec.default_nonce_length() - 5;
+            const uint32_t len = readInt<uint32_t>(in, pos);
+            const size_t end = std::min(in.size(), pos + 1 + len);
+
+            auto head = std::make_unique<StreamHead>();
+            StreamDecryptor stream(dec, keyDec, [&head](secvec &t_chunk) {
+                head->plain = t_chunk;
+            });
+
+            const int ok = stream.update(in.data(), end);
+            if (ok != 1) {
+                return ok;
+            }
+
+            if (stream.chunks() == 0) {
+                throw std::runtime_error("Encrypted stream is truncated.");
+            }
+
+            head->prefix = stream.prefix();
+            head->end = end;
+            head->last = stream.finished();
+            head->key = t_key;
+            head->keyFileKey = t_keyFileKey;
+            m_streamHead = std::move(head);
+
+            return true;
+        }
+
+        // Only reuse a head checked with these very keys.
+        std::unique_ptr<StreamHead> head = std::move(m_streamHead);
+        if (head && (head->key != t_key || head->keyFileKey != t_keyFileKey)) {
+            head.reset();
+        }
+
+        std::unique_ptr<Botan::Decompression_Algorithm> decomp = makeDecompressor(compress);
+        if (decomp) {
+            decomp->start();
+        }
+
+        // Unless every chunk authenticates, the entries decoded so far are released along with their arena.
+        ArenaReload reload(this);
+
+        // Records are decoded as soon as they're complete, so only a partial record is ever held back.
+        VectorUnion pending;
+        bool haveCount = false;
+        uint32_t count = 0;
+        QList<PDPPEntry *> loaded;
+
+        auto consume = [this, &pending, &haveCount, &count, &loaded](const secvec &t_plain) {
+            pending.insert(pending.end(), t_plain.begin(), t_plain.end());
+            size_t pos = 0;
+
+            if (!haveCount) {
+                if (pending.size() < 4) {
+                    return;
+                }
+
+                count = readInt<uint32_t>(pending, pos);
+                haveCount = true;
+            }
+
+            while (static_cast<uint32_t>(loaded.size()) < count && recordComplete(pending, pos)) {
+                loaded.emplaceBack(PDPPEntry::deserialize(pending, pos, this));
+            }
+
+            pending.erase(pending.begin(), pending.begin() + static_cast<std::ptrdiff_t>(pos));
+        };
+
+        auto sink = [&decomp, &consume](secvec &t_chunk) {
+            if (decomp) {
+                decomp->update(t_chunk);
+            }
+
+            consume(t_chunk);
+        };
+
+        StreamDecryptor stream(dec, keyDec, sink);
+
+        size_t start = 0;
+        if (head) {
+            stream.resume(head->prefix, 1, head->last);
+            sink(head->plain);
+            start = head->end;
+        }
+
+        for (size_t pos = start; pos < in.size(); pos += Constants::streamChunkSize) {
+            const int ok = stream.update(in.data() + pos, std::min(Constants::streamChunkSize, in.size() - pos));
+
+            if (ok != 1) {
+                return ok;
+            }
+        }
+
+        stream.finish();
+
+        if (decomp) {
+            secvec tail;
+            decomp->finish(tail);
+            consume(tail);
+        }
+
+        if (!haveCount || static_cast<uint32_t>(loaded.size()) != count) {
+            throw std::runtime_error("Entry records are truncated.");
+        }
+
+        if (!pending.empty()) {
+            throw std::runtime_error("Trailing data after entry records.");
+        }
+
+        reloaded(loaded);
+        reload.commit();
+
+        return true;
+    }
+
+    VectorUnion PDPPDatabase::encryptedBlocks(const VectorUnion &t_keyFileKey) {
+        Botan::Cipher_Mode &enc = cipher(m_enc, Botan::ENCRYPTION, passw);
+        Botan::Cipher_Mode *keyEnc = keyFile ? &cipher(m_keyEnc, Botan::ENCRYPTION, t_keyFileKey) : nullptr;
+
+        Botan::AutoSeeded_RNG rng;
+
+        // Blocks sealed under the previous keys can only be reused if neither the keys nor the cipher have changed since.
+        const bool reuse = passw == m_sealKey && t_keyFileKey == m_sealKeyFileKey && encryption == m_sealEncryption && keyFile == m_sealKeyFile;
+        const size_t nonceLen = enc.default_nonce_length();
+
+        VectorUnion table;
+        VectorUnion blocks;
+        uint32_t count = 0;
+
+        for (PDPPEntry *entry : m_entries) {
+            if (!entry->name().isEmpty()) {
+                ++count;
+            }
+        }
+        appendInt(table, count);
+
+        m_pendingBlocks.clear();
+        const ByteView current = cipherText();
+
+        for (PDPPEntry *entry : m_entries) {
+            if (entry->name().isEmpty()) {
+                continue;
+            }
+
+            const QByteArray nameUtf8 = entry->name().toUtf8();
+            const quint64 offset = blocks.size();
+
+            auto stubBlock = m_blocks.constFind(entry);
+            if (reuse && !entry->isLoaded() && stubBlock != m_blocks.cend()) {
+                // Untouched stubs are copied across still sealed, and stay stubs in the new data.
+                const uint8_t *in = current.data() + m_blocksOffset + stubBlock.value().offset;
+                blocks.insert(blocks.end(), in, in + stubBlock.value().length);
+                m_pendingBlocks.insert(entry, {offset, stubBlock.value().length, stubBlock.value().nonce});
+            } else {
+                if (!reuse || entry->isDirty() || entry->sealedBlock().empty()) {
+                    // Each block is bound to its entry's name, so blocks can't be swapped around.
+                    const secvec ad(nameUtf8.begin(), nameUtf8.end());
+
+                    VectorUnion block = entry->record();
+                    sealBlock(enc, keyEnc, rng, ad, block);
+                    entry->setSealedBlock(block);
                 }
-                fields.emplaceBack(new Field(vName, val, id));
+
+                const VectorUnion &block = entry->sealedBlock();
+                blocks.insert(blocks.end(), block.begin(), block.end());
+            }
+
+            appendInt(table, static_cast<uint32_t>(nameUtf8.size()));
+            table.insert(table.end(), nameUtf8.begin(), nameUtf8.end());
+            appendInt(table, static_cast<uint64_t>(offset));
+            appendInt(table, static_cast<uint32_t>(blocks.size() - offset));
+            // Every block starts with its nonce, so recording it pins the table to these exact blocks.
+            table.insert(table.end(), blocks.begin() + static_cast<std::ptrdiff_t>(offset), blocks.begin() + static_cast<std::ptrdiff_t>(offset + nonceLen));
+        }
+
+        sealBlock(enc, keyEnc, rng, {}, table);
+
+        m_sealKey = passw;
+        m_sealKeyFileKey = t_keyFileKey;
+        m_sealEncryption = encryption;
+        m_sealKeyFile = keyFile;
+
+        VectorUnion out;
+        out.reserve(4 + table.size() + blocks.size());
+        appendInt(out, static_cast<uint32_t>(table.size()));
+        out.insert(out.end(), table.begin(), table.end());
+        out.insert(out.end(), blocks.begin(), blocks.end());
+
+        m_pendingBlocksOffset = 4 + table.size();
+        return out;
+    }
+
+    int PDPPDatabase::decryptBlockTable(const VectorUnion &t_key, const VectorUnion &t_keyFileKey) {
+        const ByteView in = cipherText();
+        size_t pos = 0;
+        const uint32_t tableLen = readInt<uint32_t>(in, pos);
+        if (in.size() - pos < tableLen) {
+            std::cerr << "Entry block table is truncated." << std::endl;
+            return false;
+        }
+
+        Botan::Cipher_Mode &dec = cipher(m_dec, Botan::DECRYPTION, t_key);
+        Botan::Cipher_Mode *keyDec = keyFile ? &cipher(m_keyDec, Botan::DECRYPTION, t_keyFileKey) : nullptr;
+
+        VectorUnion table;
+        const int ok = openBlock(dec, keyDec, {}, in.data() + pos, tableLen, table);
+        if (ok != 1) {
+            return ok;
+        }
+
+        this->passw = t_key;
+        this->m_keyFileKey = t_keyFileKey;
+        this->m_sealKey = t_key;
+        this->m_sealKeyFileKey = t_keyFileKey;
+        this->m_sealEncryption = encryption;
+        this->m_sealKeyFile = keyFile;
+        this->stList = table;
+        this->m_blocksOffset = pos + tableLen;
+
+        return true;
+    }
+
+    void PDPPDatabase::loadBlockTable(const VectorUnion &t_table) {
+        size_t pos = 0;
+        const uint32_t count = readInt<uint32_t>(t_table, pos);
+        const size_t blocksLen = cipherText().size() - m_blocksOffset;
+        const size_t nonceLen = cipher(m_blockDec, Botan::DECRYPTION, m_sealKey, m_sealEncryption).default_nonce_length();
+
+        ArenaReload reload(this);
+        QList<PDPPEntry *> stubs;
+        QHash<PDPPEntry *, EntryBlock> blocks;
+
+        for (uint32_t i = 0; i < count; ++i) {
+            const uint32_t nameLen = readInt<uint32_t>(t_table, pos);
+            if (t_table.size() - pos < nameLen) {
+                throw std::runtime_error("Unexpected end of entry data.");
             }
 
-            PDPPEntry *entry = new PDPPEntry(fields, this);
-            addEntry(entry);
+            const QString eName = QString::fromUtf8(t_table.asConstChar() + pos, static_cast<qsizetype>(nameLen));
+            pos += nameLen;
+
+            EntryBlock block{readInt<uint64_t>(t_table, pos), readInt<uint32_t>(t_table, pos), {}};
+            if (block.offset > blocksLen || blocksLen - block.offset < block.length) {
+                throw std::runtime_error("Entry block lies outside of the database.");
+            }
+
+            if (t_table.size() - pos < nonceLen) {
+                throw std::runtime_error("Unexpected end of entry data.");
+            }
+
+            block.nonce = QByteArray(t_table.asConstChar() + pos, static_cast<qsizetype>(nonceLen));
+            pos += nonceLen;
+
+            PDPPEntry *stub = PDPPEntry::stub(eName, this);
+            blocks.insert(stub, block);
+            stubs.emplaceBack(stub);
         }
+
+        reloaded(stubs, blocks);
+        reload.commit();
     }
 
     bool PDPPDatabase::saveSt() {
-        for (const QString &tbl : db.tables()) {
-    #ifdef DEBUG
-            qDebug() << "deleting table" << tbl;
-    #endif
-            db.exec("DROP TABLE \"" + tbl + '"');
+        const QList<QMetaType::Type> varTypes = {QMetaType::QString, QMetaType::Double, QMetaType::Int, QMetaType::QByteArray};
+        const QList<QString> sqlTypes = {"text", "real", "integer", "blob"};
+
+        if (!db.transaction()) {
+            std::cerr << "Warning: Unable to start SQL transaction: " + db.lastError().text().toStdString() << std::endl;
+            return false;
+        }
+
+        // Stubs read from the tables rewritten below, so every entry is loaded before any of them change.
+        for (PDPPEntry *entry : m_entries) {
+            entry->ensureLoaded();
         }
-        stList = "";
+
+        QSqlDriver *driver = db.driver();
+        const QStringList tableList = db.tables();
+        QSet<QString> staleTables(tableList.begin(), tableList.end());
+        QSet<QString> writtenTables;
+
+        // Appended to in place, one entry's statements at a time.
+        stList.clear();
+        bool ok = true;
 
         for (PDPPEntry *entry : m_entries) {
             if (entry->name().isEmpty()) {
                 continue;
             }
 
-            QString createStr = "CREATE TABLE '" + entry->fieldAt(0)->dataStr() + "' (";
-            QString insertStr = "INSERT INTO '" + entry->fieldAt(0)->dataStr().replace('"', '\'') + "' (";
+            const QString tblName = entry->fieldAt(0)->dataStr();
+            const QString tbl = driver->escapeIdentifier(tblName, QSqlDriver::TableName);
+
+            QString createStr = "CREATE TABLE '" + tblName + "' (";
+            QString insertStr = "INSERT INTO '" + QString(tblName).replace('"', '\'') + "' (";
             QString valueStr = ") VALUES (";
 
+            QString columnDefs;
+            QString columnNames;
+            QString placeholders;
+
+            const QSqlRecord existing = staleTables.contains(tblName) ? db.record(tblName) : QSqlRecord();
+            bool sameSchema = existing.count() == entry->fieldLength();
+
+            // Each field's data is decoded once, for both the statement text and the bound values.
+            QList<QString> values;
+            values.reserve(entry->fieldLength());
+
             for (const int i : range(0, static_cast<int>(entry->fieldLength()))) {
                 Field *field = entry->fieldAt(i);
+                const qsizetype typeIndex = varTypes.indexOf(field->type());
+                const QString sqlType = sqlTypes[typeIndex < 0 ? 0 : typeIndex];
+                const QString column = driver->escapeIdentifier(field->name(), QSqlDriver::FieldName);
+
+                if (sameSchema && (existing.fieldName(i) != field->name() || existing.field(i).metaType().id() != varTypes[typeIndex < 0 ? 0 : typeIndex])) {
+                    sameSchema = false;
+                }
+
+                columnDefs += column + ' ' + sqlType + ", ";
+                columnNames += column + ", ";
+                placeholders += "?, ";
+
+                // The textual form kept in stList is the version 7 payload format, and is only used for compatibility.
                 QString fName = field->name();
                 fName.replace('"', '\'');
 
-                const QList<QMetaType::Type> varTypes = {QMetaType::QString, QMetaType::Double, QMetaType::Int, QMetaType::QByteArray};
-                const QList<QString> sqlTypes = {"text", "real", "integer", "blob"};
-
-                createStr += fName + ' ' + sqlTypes[varTypes.indexOf(field->type())];
+                createStr += fName + ' ' + sqlType;
                 insertStr += fName;
 
+                values.emplaceBack(field->dataStr());
+
                 QString quote = field->type() == QMetaType::QString || field->isMultiLine() ? "\"" : "";
-                valueStr += quote + field->dataStr().replace('"', '\'').replace('\n', " || char(10) || ") + quote;
+                QString escaped = values.last();
+                valueStr += quote + escaped.replace('"', '\'').replace('\n', " || char(10) || ") + quote;
 
                 createStr += ", ";
                 insertStr += ", ";
@@ -149,12 +1024,58 @@ namespace passman {
             createStr.chop(2);
             insertStr.chop(2);
             valueStr.chop(2);
+            columnDefs.chop(2);
+            columnNames.chop(2);
+            placeholders.chop(2);
 
-            db.exec(createStr + ')');
-            db.exec(insertStr + valueStr + ')');
             stList += createStr + ")\n" + insertStr + valueStr + ")\n";
+
+            QSqlQuery q(db);
+
+            // Tables whose schema is unchanged are only emptied; everything else is rebuilt.
+            // Entries sharing a name share a table, as they always have.
+            if (!writtenTables.contains(tblName)) {
+                if (sameSchema) {
+    #ifdef DEBUG
+                    qDebug() << "reusing table" << tblName;
+    #endif
+                    q.exec("DELETE FROM " + tbl);
+                } else {
+                    if (staleTables.contains(tblName)) {
+                        q.exec("DROP TABLE " + tbl);
+                    }
+                    q.exec("CREATE TABLE " + tbl + " (" + columnDefs + ')');
+                }
+
+                staleTables.remove(tblName);
+                writtenTables.insert(tblName);
+            }
+
+            q.prepare("INSERT INTO " + tbl + " (" + columnNames + ") VALUES (" + placeholders + ')');
+            for (const QString &value : values) {
+                q.addBindValue(value);
+            }
+
+            if (!q.exec()) {
+                std::cerr << "Warning: SQL error while saving entry " + tblName.toStdString() + ": " + q.lastError().text().toStdString() << std::endl;
+                ok = false;
+            }
         }
-        return true;
+
+        for (const QString &tbl : staleTables) {
+    #ifdef DEBUG
+            qDebug() << "deleting table" << tbl;
+    #endif
+            db.exec("DROP TABLE " + driver->escapeIdentifier(tbl, QSqlDriver::TableName));
+        }
+
+        if (!db.commit()) {
+            std::cerr << "Warning: Unable to commit SQL transaction: " + db.lastError().text().toStdString() << std::endl;
+            db.rollback();
+            return false;
+        }
+
+        return ok;
     }
 
     bool PDPPDatabase::isOld() {
@@ -192,85 +1113,308 @@ namespace passman {
 
         ph->derive_key(mptr.data(), mptr.size(), t_password.asConstChar(), t_password.size(), iv.data(), iv.size());
 
-        KDF *kdf = makeKdf();
+        const std::shared_ptr<KDF> kdf = makeKdf();
         auto decr = kdf->makeDecryptor(0);
         decr->set_key(mptr);
         decr->start(ivd);
 
-        VectorUnion vData = f.readAll();
+        VectorUnion vData = f.readAll();
+
+        try {
+            decr->finish(vData);
+            this->passw = kdf->transform(t_password);
+        }  catch (std::exception &e) {
+            return false;
+        }
+
+        this->stList = vData;
+
+        for (const QString &s : vData.asQStr().split('\n')) {
+            if (s.isEmpty()) {
+                continue;
+            }
+
+            QSqlQuery finalQ(db);
+
+            if (!finalQ.exec(s)) {
+                std::cerr << "libpassman warning: SQL execution error during database conversion: " + finalQ.lastError().text().toStdString() + "\nQuery: " + s.toStdString() << std::endl;
+            }
+
+            finalQ.finish();
+        }
+
+        get();
+
+        encrypt();
+        f.close();
+        return true;
+    }
+
+    VectorUnion PDPPDatabase::deriveKeyFileKey(const std::shared_ptr<KDF> &t_kdf, const std::function<void()> &t_work) {
+        if (!keyFile) {
+            t_work();
+            return {};
+        }
+
+        // Both derivations are memory-hard and independent, so the key file's gets its own thread.
+        // KDF::transform is safe to call from several threads, so the KDF can be shared.
+        std::future<VectorUnion> key = std::async(std::launch::async, [t_kdf] {
+            return t_kdf->transform(t_kdf->readKeyFile());
+        });
+
+        t_work();
+        return key.get();
+    }
+
+    void PDPPDatabase::prepareRecords() {
+        for (PDPPEntry *entry : m_entries) {
+            if (entry->isLoaded() && !entry->name().isEmpty()) {
+                entry->record();
+            }
+        }
+    }
+
+    // Entries still sealed in their blocks are read from the file, so they must be loaded before it's unmapped or replaced.
+    void PDPPDatabase::loadBlocks() {
+        for (PDPPEntry *entry : m_entries) {
+            if (m_blocks.contains(entry)) {
+                entry->ensureLoaded();
+            }
+        }
+    }
+
+    VectorUnion PDPPDatabase::encryptedData() {
+        const std::shared_ptr<KDF> kdf = makeKdf();
+
+        if (layout == EntryBlocks || layout == Stream) {
+            // Sealing needs both keys up front, so only serialization can overlap with the key file derivation.
+            const VectorUnion keyPtr = deriveKeyFileKey(kdf, [this] {
+                prepareRecords();
+            });
+
+            if (layout == EntryBlocks) {
+                return encryptedBlocks(keyPtr);
+            }
+
+            VectorUnion out;
+            sealStream(keyPtr, [&out](const secvec &t_out) {
+                out.insert(out.end(), t_out.begin(), t_out.end());
+            });
+
+            return out;
+        }
+
+        VectorUnion pt;
+
+        // Serialize, compress and encrypt the password layer while the key file key is derived.
+        const VectorUnion keyPtr = deriveKeyFileKey(kdf, [this, &pt] {
+            Botan::Cipher_Mode &enc = cipher(m_enc, Botan::ENCRYPTION, passw);
+            // Files are always written at the latest version, whose payload is the binary entry records.
+            pt = serializeEntries();
+
+            if (auto ptComp = makeCompressor(compress)) {
+                ptComp->start(compressionLevel);
+                ptComp->finish(pt);
+            }
+
+            enc.start(iv);
+            enc.finish(pt);
+        });
+
+        if (keyFile) {
+            Botan::Cipher_Mode &keyEnc = cipher(m_keyEnc, Botan::ENCRYPTION, keyPtr);
+            keyEnc.start(iv);
+            keyEnc.finish(pt);
+        }
+
+        return pt;
+    }
+
+    void PDPPDatabase::save() {
+        const quint64 sequence = ++m_saveSequence;
+
+        QMutexLocker lock(&m_saveMutex);
+        encrypt();
+
+        m_writtenSequence = sequence;
+        modified = false;
+    }
+
+    PDPPDatabase *PDPPDatabase::snapshot() {
+        PDPPDatabase *copy = new PDPPDatabase();
+
+        copy->keyFile = keyFile;
+        copy->hmac = hmac;
+        copy->hash = hash;
+        copy->hashIters = hashIters;
+        copy->encryption = encryption;
+        copy->memoryUsage = memoryUsage;
+        copy->m_memoryCost = m_memoryCost;
+        copy->parallelism = parallelism;
+        copy->clearSecs = clearSecs;
+        copy->compress = compress;
+        copy->compressionLevel = compressionLevel;
+        copy->layout = layout;
+        copy->iv = iv;
+        copy->ivLen = ivLen;
+        copy->name = name;
+        copy->desc = desc;
+        copy->path = path;
+        copy->keyFilePath = keyFilePath;
+        copy->passw = passw;
+
+        copy->m_sealKey = m_sealKey;
+        copy->m_sealKeyFileKey = m_sealKeyFileKey;
+        copy->m_sealEncryption = m_sealEncryption;
+        copy->m_sealKeyFile = m_sealKeyFile;
+
+        // Only the EntryBlocks layout can carry unloaded blocks across still sealed; anything else needs them decrypted first.
+        if (layout != EntryBlocks) {
+            loadBlocks();
+        }
+
+        // The file is about to be replaced. Data the database still reads from it must be moved into memory first,
+        // and unloaded blocks need copying so the snapshot can carry them across still sealed.
+        if (m_mapFile) {
+            if (layout != Stream) {
+                const ByteView in = m_mapped;
+                data.assign(in.data(), in.data() + in.size());
+            }
 
-        try {
-            decr->finish(vData);
-            this->passw = kdf->transform(t_password);
-        }  catch (std::exception &e) {
-            return false;
+            unmap();
         }
 
-        this->stList = vData;
+        if (!m_blocks.isEmpty()) {
+            copy->data = data;
+            copy->m_blocksOffset = m_blocksOffset;
+        }
 
-        for (const QString &s : vData.asQStr().split('\n')) {
-            if (s.isEmpty()) {
+        QList<PDPPEntry *> entries;
+        for (PDPPEntry *entry : m_entries) {
+            if (entry->name().isEmpty()) {
                 continue;
             }
 
-            QSqlQuery finalQ(db);
+            auto block = m_blocks.constFind(entry);
+            if (!entry->isLoaded() && block == m_blocks.cend()) {
+                entry->ensureLoaded();
+            }
 
-            if (!finalQ.exec(s)) {
-                std::cerr << "libpassman warning: SQL execution error during database conversion: " + finalQ.lastError().text().toStdString() + "\nQuery: " + s.toStdString() << std::endl;
+            PDPPEntry *entryCopy = entry->snapshot(copy);
+            if (block != m_blocks.cend()) {
+                copy->m_blocks.insert(entryCopy, block.value());
             }
 
-            finalQ.finish();
+            entries.emplaceBack(entryCopy);
         }
 
-        get();
+        copy->m_entries = entries;
+        return copy;
+    }
 
-        encrypt();
-        f.close();
-        return true;
+    QFuture<bool> PDPPDatabase::saveAsync() {
+        PDPPDatabase *copy = snapshot();
+        const quint64 sequence = ++m_saveSequence;
+
+        // Restored if the save fails, so a clean database isn't marked dirty by a failed save.
+        const bool wasModified = modified.exchange(false);
+
+        // QThreadPool::start needs a copyable callable, and QPromise is move-only.
+        auto promise = std::make_shared<QPromise<bool>>();
+        QFuture<bool> future = promise->future();
+        promise->start();
+
+        QThreadPool::globalInstance()->start([this, copy, sequence, wasModified, promise] {
+            bool ok = true;
+
+            try {
+                QMutexLocker lock(&m_saveMutex);
+
+                if (sequence > m_writtenSequence) {
+                    copy->encrypt();
+                    m_writtenSequence = sequence;
+                }
+            } catch (std::exception &e) {
+                std::cerr << e.what() << std::endl;
+                ok = false;
+
+                // Changes made since the snapshot already set it, so it's only ever raised here, never lowered.
+                if (wasModified) {
+                    modified = true;
+                }
+            }
+
+            // The snapshot's entries and fields live in its arena, and go with it.
+            delete copy;
+
+            promise->addResult(ok);
+            promise->finish();
+        });
+
+        trackTask(QFuture<void>(future));
+        return future;
     }
 
-    VectorUnion PDPPDatabase::encryptedData() {
-        KDF *kdf = makeKdf();
-        auto enc = kdf->makeEncryptor();
-        enc->set_key(passw);
-    #ifdef DEBUG
-        qDebug() << "STList before saveSt:" << stList.asStdStr().data();
-    #endif
+    void PDPPDatabase::encrypt() {
+        version = Constants::maxVersion;
+        // A checked first chunk belongs to the file about to be replaced.
+        m_streamHead.reset();
 
-        saveSt();
+        if (layout == Stream) {
+            // Only EntryBlocks can carry blocks across still sealed; the rest are read before the file goes away.
+            loadBlocks();
 
-    #ifdef DEBUG
-        qDebug() << "STList after saveSt:" << stList.asStdStr().data();
-    #endif
+            const VectorUnion keyPtr = deriveKeyFileKey(makeKdf(), [this] {
+                prepareRecords();
+            });
+
+            // The old data must be unmapped before the file is replaced.
+            unmap();
 
-        VectorUnion pt = stList;
+            DataStream pd(path.asQStr());
+            writeHeader(pd);
+            m_dataOffset = static_cast<size_t>(pd.pos());
 
-        if (compress) {
-            auto ptComp = Botan::Compression_Algorithm::create("gzip");
+            sealStream(keyPtr, [&pd](const secvec &t_out) {
+                pd.write(t_out.data(), t_out.size());
+            });
+            pd.finish();
 
-            ptComp->start();
-            ptComp->finish(pt);
+            data.clear();
+            m_blocks.clear();
+            return;
         }
 
-        enc->start(iv);
-        enc->finish(pt);
+        data = this->encryptedData();
+        unmap();
 
-        if (keyFile) {
-            const VectorUnion keyPw = kdf->readKeyFile();
+        // Stubs that were copied across still sealed now live at new offsets.
+        m_blocks = layout == EntryBlocks ? m_pendingBlocks : QHash<PDPPEntry *, EntryBlock>();
+        m_blocksOffset = m_pendingBlocksOffset;
+        m_pendingBlocks.clear();
 
-            auto keyEnc = kdf->makeEncryptor();
+        write();
+    }
 
-            keyEnc->set_key(kdf->transform(keyPw));
-            keyEnc->start(iv);
-            keyEnc->finish(pt);
+    void PDPPDatabase::write() {
+        if (m_mapFile) {
+            const ByteView in = m_mapped;
+            data.assign(in.data(), in.data() + in.size());
+            unmap();
         }
 
-        return pt;
-    }
+        DataStream pd(path.asQStr());
+        writeHeader(pd);
 
-    void PDPPDatabase::encrypt() {
-        DataStream pd(path.asStdStr(), std::fstream::binary | std::fstream::trunc);
+    #ifdef DEBUG
+        qDebug() << "Data (Encryption):" << data.hex_encode().asQStr();
+    #endif
+
+        pd << data;
+        pd.finish();
+    }
 
+    void PDPPDatabase::writeHeader(DataStream &pd) {
         pd << "PD++";
 
         pd << Constants::maxVersion;
@@ -285,24 +1429,22 @@ namespace passman {
         pd << encryption;
 
         if (hash == 0) {
-            pd << memoryUsage;
+            pd << memoryCost();
+        }
+
+        if (hash == 0 || hash == 2) {
+            pd << parallelism;
         }
 
         pd << clearSecs;
         pd << compress;
+        pd << compressionLevel;
+        pd << layout;
 
         pd << iv;
 
         pd << name << '\n';
         pd << desc << '\n';
-
-        data = this->encryptedData();
-    #ifdef DEBUG
-        qDebug() << "Data (Encryption):" << data.hex_encode().asQStr();
-    #endif
-
-        pd << data;
-        pd.finish();
     }
 
     int PDPPDatabase::verify(const VectorUnion &t_password) {
@@ -310,44 +1452,73 @@ namespace passman {
             return convert(t_password);
         }
 
-        VectorUnion t_data = data;
-        KDF *kdf = makeKdf();
-        VectorUnion vPtr = kdf->transform(t_password);
+        const std::shared_ptr<KDF> kdf = makeKdf();
+        VectorUnion vPtr;
+        const VectorUnion keyPtr = deriveKeyFileKey(kdf, [kdf, &vPtr, &t_password] {
+            vPtr = kdf->transform(t_password);
+        });
 
-        if (keyFile) {
-            VectorUnion keyPw = kdf->readKeyFile();
+        return decryptData(vPtr, keyPtr);
+    }
 
-            auto keyDec = kdf->makeDecryptor();
+    int PDPPDatabase::decryptData(const VectorUnion &t_key, const VectorUnion &t_keyFileKey) {
+        if (version >= 8 && layout == Stream) {
+            try {
+                const int ok = decryptStream(t_key, t_keyFileKey, false);
+                if (ok == 1) {
+                    this->passw = t_key;
+                    this->m_keyFileKey = t_keyFileKey;
+                }
 
-            keyDec->set_key(kdf->transform(keyPw));
-            keyDec->start(iv);
+                return ok;
+            } catch (std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                return false;
+            }
+        }
 
+        if (version >= 8 && layout == EntryBlocks) {
             try {
-                keyDec->finish(t_data);
+                return decryptBlockTable(t_key, t_keyFileKey);
             } catch (std::exception& e) {
                 std::cerr << e.what() << std::endl;
-                return 3;
+                return false;
             }
         }
 
-        auto decr = kdf->makeDecryptor();
+        // The only copy of the ciphertext, made to decrypt it in place.
+        const ByteView in = cipherText();
+        VectorUnion t_data;
+        t_data.assign(in.data(), in.data() + in.size());
 
-        decr->set_key(vPtr);
-        decr->start(iv);
+        if (keyFile) {
+            Botan::Cipher_Mode &keyDec = cipher(m_keyDec, Botan::DECRYPTION, t_keyFileKey);
+            keyDec.start(iv);
+
+            try {
+                keyDec.finish(t_data);
+            } catch (std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                return 3;
+            }
+        }
+
+        Botan::Cipher_Mode &decr = cipher(m_dec, Botan::DECRYPTION, t_key);
+        decr.start(iv);
 
     #ifdef DEBUG
         qDebug() << "Data (Decryption):" << t_data.hex_encode().asQStr();
     #endif
 
         try {
-            decr->finish(t_data);
-            if (compress) {
-                auto dataDe = Botan::Decompression_Algorithm::create("gzip");
+            decr.finish(t_data);
+            if (auto dataDe = makeDecompressor(compress)) {
                 dataDe->start();
                 dataDe->finish(t_data);
             }
 
-            this->passw = vPtr;
+            this->passw = t_key;
+            this->m_keyFileKey = t_keyFileKey;
             this->stList = t_data;
 
             return true;
@@ -366,19 +1537,22 @@ namespace passman {
 
         if (ok == true) {
             if (t_options & Open) {
-                if (!(t_options & Convert)) {
-                    for (const QString &line : stList.asQStr().split('\n')) {
-                        if (line.isEmpty()) {
-                            continue;
-                        }
-
-                        QSqlQuery q(db);
-                        if (!q.exec(line)) {
-                           std::cerr << "Warning: Error during database initialization: " + q.lastError().text().toStdString() << std::endl;
+                if (version >= 8) {
+                    if (layout == Stream) {
+                        if (decryptStream(passw, m_keyFileKey, true) != 1) {
+                            throw std::runtime_error("Database data failed to decrypt; it may be corrupt.");
                         }
+                    } else if (layout == EntryBlocks) {
+                        loadBlockTable(stList);
+                    } else {
+                        loadEntries(stList);
+                    }
+                } else {
+                    if (!(t_options & Convert)) {
+                        replay();
                     }
+                    get();
                 }
-                get();
             }
             return true;
         }
@@ -391,73 +1565,192 @@ namespace passman {
         return false;
     }
 
+    bool PDPPDatabase::replay() {
+        return replayInto(db);
+    }
+
+    bool PDPPDatabase::replayInto(const QSqlDatabase &t_sql) {
+        bool ok = true;
+
+        for (const QString &line : stList.asQStr().split('\n')) {
+            if (line.isEmpty()) {
+                continue;
+            }
+
+            QSqlQuery q(t_sql);
+            if (!q.exec(line)) {
+               std::cerr << "Warning: Error during database initialization: " + q.lastError().text().toStdString() << std::endl;
+               ok = false;
+            }
+        }
+
+        return ok;
+    }
+
+    ByteView PDPPDatabase::mapFile() {
+        unmap();
+
+        auto f = std::make_unique<QFile>(path.asQStr());
+        if (!f->open(QIODevice::ReadOnly)) {
+            throw std::runtime_error("Unable to read the database file.");
+        }
+
+        const qint64 size = f->size();
+        if (size == 0) {
+            return {};
+        }
+
+        const uchar *map = f->map(0, size);
+        if (!map) {
+            throw std::runtime_error("Unable to map the database file.");
+        }
+
+        m_mapFile = std::move(f);
+        return {map, static_cast<size_t>(size)};
+    }
+
+    void PDPPDatabase::unmap() {
+        m_mapped = {};
+        m_mapFile.reset();
+    }
+
+    ByteView PDPPDatabase::cipherText() {
+        if (m_mapFile) {
+            return m_mapped;
+        }
+
+        return {data.data(), data.size()};
+    }
+
     int PDPPDatabase::parse() {
         if (isOld()) {
             return 2;
         }
-        QFile f(path.asQStr());
-        f.open(QIODevice::ReadOnly);
-        QDataStream q(&f);
 
-        char readData[4];
-        q.readRawData(readData, 4);
+        const ByteView file = mapFile();
+        size_t pos = 4;
 
-        if (std::string(readData, 4) != "PD++") {
+        if (file.size() < 4 || std::string(reinterpret_cast<const char *>(file.data()), 4) != "PD++") {
             throw std::runtime_error("Invalid magic number. Should be PD++.");
         }
 
-        q >> version;
+        auto readByte = [&file, &pos]() -> uint8_t {
+            if (pos >= file.size()) {
+                throw std::runtime_error("Unexpected end of file.");
+            }
+
+            return file[pos++];
+        };
+
+        // Lines are read up to (and past) the next newline, or to the end of the file.
+        auto readLine = [&file, &pos]() {
+            const uint8_t *start = file.data() + pos;
+            const void *newline = std::memchr(start, '\n', file.size() - pos);
+            const size_t len = newline ? static_cast<size_t>(static_cast<const uint8_t *>(newline) - start) : file.size() - pos;
+
+            pos += newline ? len + 1 : len;
+            return QString::fromUtf8(reinterpret_cast<const char *>(start), static_cast<qsizetype>(len)).trimmed();
+        };
+
+        version = readByte();
         if (version > Constants::maxVersion) {
             throw std::runtime_error("Invalid version number.");
         }
 
-        q >> hmac;
+        hmac = readByte();
         if (hmac >= Constants::hmacMatch.size()){
             throw std::runtime_error("Invalid HMAC option.");
         }
 
         if (version < 6) {
-            q.skipRawData(1);
+            readByte();
         }
 
-        q >> hash;
+        hash = readByte();
         if (hash >= Constants::hashMatch.size()){
             throw std::runtime_error("Invalid hash option.");
         }
 
         if (hash != 3) {
-            q >> hashIters;
+            hashIters = readByte();
         }
 
-        q >> keyFile;
+        keyFile = readByte() != 0;
 
-        q >> encryption;
-        if (encryption >= Constants::encryptionMatch.size()){
+        encryption = readByte();
+        // ChaCha20-Poly1305 came with version 8.
+        if (encryption >= Constants::encryptionMatch.size() || (version < 8 && encryption == 4)){
             throw std::runtime_error("Invalid encryption option.");
         }
 
-        if (version >= 7) {
+        parallelism = 1;
+        m_memoryCost = 0;
+
+        if (version >= 8) {
+            // The exact memory cost in KiB (big-endian), then the parallelism.
             if (hash == 0) {
-                q >> memoryUsage;
+                for (int i = 0; i < 4; ++i) {
+                    m_memoryCost = m_memoryCost << 8 | readByte();
+                }
+
+                memoryUsage = m_memoryCost / 1000;
+            }
+
+            if (hash == 0 || hash == 2) {
+                parallelism = readByte();
+                if (parallelism == 0) {
+                    throw std::runtime_error("Invalid parallelism.");
+                }
+            }
+        } else if (version == 7 && hash == 0) {
+            // Memory in MB, big-endian, as QDataStream reads it.
+            const uint8_t high = readByte();
+            memoryUsage = static_cast<uint16_t>(high << 8 | readByte());
+
+            // The KDF used to take a 16-bit cost, so anything above 65 MB wrapped around. Keep deriving the same keys.
+            m_memoryCost = static_cast<uint16_t>(memoryUsage * 1000);
+        }
+
+        if (version >= 7) {
+            clearSecs = readByte();
+            compress = readByte();
+        }
+
+        compressionLevel = 0;
+        if (version >= 8) {
+            if (!compressionAvailable(compress)) {
+                throw std::runtime_error("Unsupported compression option.");
             }
-            q >> clearSecs;
-            q >> compress;
+
+            compressionLevel = readByte();
+        } else if (compress > 1) {
+            // Version 7 only stored on/off, for gzip.
+            compress = 1;
         }
 
-        ivLen = (new KDF({{"encryption", encryption}}))->makeEncryptor()->default_nonce_length();
+        layout = SinglePayload;
+        if (version >= 8) {
+            layout = readByte();
+            if (layout > Stream) {
+                throw std::runtime_error("Invalid data layout.");
+            }
+        }
 
-        char *ivc = new char[ivLen];
-        q.readRawData(ivc, static_cast<int>(ivLen));
-        iv = VectorUnion(ivc, static_cast<int>(ivLen));
+        ivLen = KDF::nonceLength(encryption);
+        if (file.size() - pos < ivLen) {
+            throw std::runtime_error("Unexpected end of file.");
+        }
 
-        name = QString(f.readLine()).trimmed();
-        desc = QString(f.readLine()).trimmed();
+        iv.assign(file.data() + pos, file.data() + pos + ivLen);
+        pos += ivLen;
 
-        const qint64 available = f.bytesAvailable();
-        char *datac = new char[available];
+        name = readLine();
+        desc = readLine();
 
-        q.readRawData(datac, static_cast<int>(available));
-        data = VectorUnion(datac, static_cast<int>(available));
+        // The encrypted data stays in the mapping until it's decrypted.
+        data.clear();
+        m_dataOffset = pos;
+        m_mapped = file.mid(pos);
 
         return true;
     }
@@ -496,15 +1789,174 @@ namespace passman {
         return false;
     }
 
+    void PDPPDatabase::loadSqlEntries() {
+        // Connections can't be shared between threads, so this gets its own, named after the database.
+        const QString connection = "passman-open-" + QString::number(reinterpret_cast<quintptr>(this), 16);
+
+        {
+            QSqlDatabase sql = QSqlDatabase::addDatabase("QSQLITE", connection);
+            sql.setDatabaseName(":memory:");
+
+            if (!sql.open()) {
+                const std::string error = sql.lastError().text().toStdString();
+                sql = QSqlDatabase();
+                QSqlDatabase::removeDatabase(connection);
+                throw std::runtime_error("Unable to open a SQL connection: " + error);
+            }
+
+            replayInto(sql);
+            m_oldFormat = isOld();
+
+            ArenaReload reload(this);
+            QList<PDPPEntry *> loaded;
+            for (const QString &tbl : sql.tables()) {
+                loaded.emplaceBack(makeEntry(readTable(sql, tbl)));
+            }
+
+            sql.close();
+            reloaded(loaded);
+            reload.commit();
+        }
+
+        QSqlDatabase::removeDatabase(connection);
+    }
+
+    int PDPPDatabase::unlock(const QString &t_password, const QString &t_keyFile, const std::function<bool(int, const QString &)> &t_stage) {
+        try {
+            if (!t_stage(0, tr("Reading database"))) {
+                return -1;
+            }
+
+            if (!QFile::exists(path.asQStr())) {
+                std::cerr << "Invalid path provided.\n";
+                return false;
+            }
+
+            if (parse() != 1) {
+                return 2;
+            }
+
+            if (keyFile && !t_keyFile.isEmpty()) {
+                keyFilePath = t_keyFile;
+            }
+
+            if (!t_stage(1, tr("Deriving keys"))) {
+                return -1;
+            }
+
+            const std::shared_ptr<KDF> kdf = makeKdf();
+            VectorUnion key;
+            const VectorUnion keyFileKey = deriveKeyFileKey(kdf, [kdf, &key, &t_password] {
+                key = kdf->transform(t_password);
+            });
+
+            if (!t_stage(2, tr("Decrypting"))) {
+                return -1;
+            }
+
+            const int ok = decryptData(key, keyFileKey);
+            if (ok != 1) {
+                return ok;
+            }
+
+            if (!t_stage(3, tr("Loading entries"))) {
+                return -1;
+            }
+
+            if (version >= 8) {
+                if (layout == Stream) {
+                    if (decryptStream(passw, m_keyFileKey, true) != 1) {
+                        throw std::runtime_error("Database data failed to decrypt; it may be corrupt.");
+                    }
+                } else if (layout == EntryBlocks) {
+                    loadBlockTable(stList);
+                } else {
+                    loadEntries(stList);
+                }
+            } else {
+                loadSqlEntries();
+            }
+
+            t_stage(4, tr("Done"));
+            return true;
+        } catch (std::exception &e) {
+            std::cerr << e.what() << std::endl;
+            return false;
+        }
+    }
+
+    QFuture<int> PDPPDatabase::openAsync(const QString &t_password, const QString &t_keyFile) {
+        auto promise = std::make_shared<QPromise<int>>();
+        QFuture<int> future = promise->future();
+        promise->start();
+        promise->setProgressRange(0, 4);
+
+        QThreadPool::globalInstance()->start([this, t_password, t_keyFile, promise] {
+            const int result = unlock(t_password, t_keyFile, [&promise](const int t_step, const QString &t_text) {
+                if (promise->isCanceled()) {
+                    return false;
+                }
+
+                promise->setProgressValueAndText(t_step, t_text);
+                return true;
+            });
+
+            // Cancelled opens finish without a result. close() would wait for this very task, so the vault is discarded directly.
+            if (result >= 0) {
+                promise->addResult(result);
+            } else {
+                discard();
+            }
+            promise->finish();
+        });
+
+        trackTask(QFuture<void>(future));
+        return future;
+    }
+
+    QList<PDPPDatabase::UnlockResult> PDPPDatabase::openBatch(const QList<UnlockRequest> &t_vaults, QThreadPool *t_pool) {
+        QList<UnlockResult> results(t_vaults.size());
+        // Every task writes only its own element, so the list must not reallocate while they run.
+        UnlockResult *out = results.data();
+        QSemaphore done;
+
+        for (qsizetype i = 0; i < t_vaults.size(); ++i) {
+            const UnlockRequest vault = t_vaults.at(i);
+            out[i].path = vault.path;
+
+            t_pool->start([vault, result = out + i, &done] {
+                PDPPDatabase *database = new PDPPDatabase();
+                database->path = vault.path;
+
+                result->result = database->unlock(vault.password, vault.keyFile, [](int, const QString &) {
+                    return true;
+                });
+
+                if (result->result == 1) {
+                    result->database = database;
+                } else {
+                    delete database;
+                }
+
+                done.release();
+            });
+        }
+
+        done.acquire(static_cast<int>(t_vaults.size()));
+        return results;
+    }
+
     int PDPPDatabase::saveAs(const QString &t_fileName) {
         if (t_fileName.isEmpty()) {
             return 3;
         }
 
+        // Only check for permission here; an existing file is replaced atomically by save().
         QFile file(t_fileName);
-        if (!file.open(QIODevice::WriteOnly)) {
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Append)) {
             return 17;
         }
+        file.close();
 
         try {
             path = t_fileName;
@@ -515,7 +1967,132 @@ namespace passman {
         return true;
     }
 
-    KDF *PDPPDatabase::makeKdf(uint8_t t_hmac, uint8_t t_hash, uint8_t t_encryption, VectorUnion t_seed, VectorUnion t_keyFile, uint8_t t_hashIters, uint16_t t_memoryUsage)
+    QVariantMap PDPPDatabase::params() {
+        return {
+            {"hmac", hmac},
+            {"hash", hash},
+            {"hashiters", hashIters},
+            {"encryption", encryption},
+            {"version", version},
+            {"memory", memoryUsage},
+            {"parallelism", parallelism},
+            {"clearsecs", clearSecs},
+            {"compression", compress},
+            {"compressionlevel", compressionLevel},
+            {"layout", layout},
+            {"iv", iv.asQByteArray()},
+            {"path", path.asQByteArray()},
+            {"name", name.asQByteArray()},
+            {"desc", desc.asQByteArray()},
+            {"keyfile", keyFile ? keyFilePath.asQStr() : QString()}
+        };
+    }
+
+    QVariantMap PDPPDatabase::calibrateKdf(const int t_msec, const uint32_t t_maxMemory) {
+        QVariantMap p = params();
+        const double target = t_msec;
+        const uint32_t maxMemory = std::max<uint32_t>(t_maxMemory, 1);
+
+        // Candidates get a KDF of their own, so the database's cached one isn't rebuilt for each of them.
+        auto time = [this](const uint32_t t_iters, const uint32_t t_memory, const uint32_t t_parallelism) {
+            KDF kdf(kdfParams(63, 63, 63, {}, {}, static_cast<uint8_t>(t_iters), t_memory));
+            kdf.setI3(t_parallelism);
+            return kdf.measure();
+        };
+
+        // Largest value in [t_low, t_max] whose derivations fit the target; t_low is returned even if it doesn't.
+        auto tune = [target](uint32_t t_low, const uint32_t t_max, const std::function<double(uint32_t)> &t_time) {
+            const double elapsed = t_time(t_low);
+            if (elapsed >= target || t_low >= t_max) {
+                return t_low;
+            }
+
+            // Derivation time grows about linearly, so start just past the linear estimate.
+            uint32_t high = static_cast<uint32_t>(std::clamp<double>(t_low * target / elapsed * 1.25, t_low + 1, t_max));
+            while (t_time(high) <= target) {
+                if (high == t_max) {
+                    return t_max;
+                }
+
+                t_low = high;
+                high = std::min<uint32_t>(t_max, high * 2);
+            }
+
+            // Timings are too noisy for a bracket tighter than ~5% to mean anything.
+            while (high - t_low > std::max<uint32_t>(1, t_low / 20)) {
+                const uint32_t mid = t_low + (high - t_low) / 2;
+                (t_time(mid) <= target ? t_low : high) = mid;
+            }
+
+            return t_low;
+        };
+
+        switch (hash) {
+            case 0: {
+                // Botan 2 computes lanes one after another, so more of them would only multiply the cost, differently on every machine.
+                const uint32_t lanes = 1;
+
+                // The first derivation pays for faulting in fresh memory; keep it out of the timings.
+                time(1, std::min<uint32_t>(8, maxMemory), lanes);
+
+                const uint32_t memory = tune(std::min<uint32_t>(8, maxMemory), maxMemory, [&time, lanes](const uint32_t t_memory) {
+                    return time(1, t_memory, lanes);
+                });
+
+                uint32_t iters = 1;
+                if (memory == maxMemory) {
+                    iters = tune(1, 255, [&time, memory, lanes](const uint32_t t_iters) {
+                        return time(t_iters, memory, lanes);
+                    });
+                }
+
+                p.insert({{"memory", memory}, {"hashiters", iters}, {"parallelism", lanes}});
+                break;
+            } case 1: {
+                const uint32_t iters = tune(1, 255, [&time](const uint32_t t_iters) {
+                    return time(t_iters, 0, 1);
+                });
+
+                p.insert({{"hashiters", iters}, {"parallelism", 1}});
+                break;
+            } case 2: {
+                // makeKdf fixes N at 32768 and uses the iterations as r, so every step of r costs 128 * N bytes.
+                const uint32_t maxR = static_cast<uint32_t>(std::clamp<uint64_t>(maxMemory * 1000000ull / (128ull * 32768), 1, 255));
+
+                time(1, 0, 1);
+
+                const uint32_t r = tune(1, maxR, [&time](const uint32_t t_r) {
+                    return time(t_r, 0, 1);
+                });
+
+                uint32_t parallel = 1;
+                if (r == maxR) {
+                    parallel = tune(1, 255, [&time, r](const uint32_t t_parallelism) {
+                        return time(r, 0, t_parallelism);
+                    });
+                }
+
+                p.insert({{"hashiters", r}, {"parallelism", parallel}});
+                break;
+            } default: {
+                // Nothing to tune without a hash function.
+                break;
+            }
+        }
+
+        return p;
+    }
+
+    uint32_t PDPPDatabase::memoryCost(const uint32_t t_memoryUsage) {
+        if (t_memoryUsage != 0) {
+            return t_memoryUsage * 1000;
+        }
+
+        return m_memoryCost != 0 ? m_memoryCost : memoryUsage * 1000;
+    }
+
+    QVariantMap PDPPDatabase::kdfParams(uint8_t t_hmac, uint8_t t_hash, uint8_t t_encryption, const VectorUnion &t_seed, const VectorUnion &t_keyFile, uint8_t t_hashIters,
+                                        uint32_t t_memoryUsage)
     {
         QVariantMap kdfMap({
             {"hmac", t_hmac == 63 ? hmac : t_hmac},
@@ -530,16 +2107,16 @@ namespace passman {
         switch (t_hash == 63 ? hash : t_hash) {
             case 0: {
                 kdfMap.insert({
-                                  {"i1", (t_memoryUsage == 0 ? memoryUsage : t_memoryUsage) * 1000},
+                                  {"i1", memoryCost(t_memoryUsage)},
                                   {"i2", iters},
-                                  {"i3", 1}
+                                  {"i3", parallelism}
                               });
                 break;
             } case 2: {
                 kdfMap.insert({
                                   {"i1", 32768},
                                   {"i2", iters},
-                                  {"i3", 1}
+                                  {"i3", parallelism}
                               });
                 break;
             } default: {
@@ -547,6 +2124,40 @@ namespace passman {
                 break;
             }
         }
-        return new KDF(kdfMap);
+        return kdfMap;
+    }
+
+    Botan::Cipher_Mode &PDPPDatabase::cipher(KeyedCipher &t_cache, const Botan::Cipher_Dir t_direction, const VectorUnion &t_key) {
+        return cipher(t_cache, t_direction, t_key, encryption);
+    }
+
+    Botan::Cipher_Mode &PDPPDatabase::cipher(KeyedCipher &t_cache, const Botan::Cipher_Dir t_direction, const VectorUnion &t_key, const uint8_t t_encryption) {
+        if (!t_cache.mode || t_cache.encryption != t_encryption) {
+            t_cache.mode = Botan::Cipher_Mode::create(Constants::encryptionMatch.at(t_encryption), t_direction);
+            t_cache.encryption = t_encryption;
+            t_cache.key = {};
+        }
+
+        if (t_cache.key.empty() || t_cache.key != t_key) {
+            t_cache.mode->set_key(t_key);
+            t_cache.key = t_key;
+        }
+
+        // A message left half done by a failed decryption mustn't leak into the next one.
+        t_cache.mode->reset();
+        return *t_cache.mode;
+    }
+
+    std::shared_ptr<KDF> PDPPDatabase::makeKdf(uint8_t t_hmac, uint8_t t_hash, uint8_t t_encryption, VectorUnion t_seed, VectorUnion t_keyFile, uint8_t t_hashIters, uint32_t t_memoryUsage)
+    {
+        const QVariantMap kdfMap = kdfParams(t_hmac, t_hash, t_encryption, t_seed, t_keyFile, t_hashIters, t_memoryUsage);
+
+        QMutexLocker lock(&m_kdfMutex);
+        if (!m_kdf || kdfMap != m_kdfParams) {
+            m_kdf = std::make_shared<KDF>(kdfMap);
+            m_kdfParams = kdfMap;
+        }
+
+        return m_kdf;
     }
 }
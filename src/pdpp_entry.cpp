@@ -5,20 +5,243 @@
 #include <QString>
 
 #include "pdpp_entry.hpp"
+#include "pdpp_database.hpp"
+#include "arena.hpp"
 #include "extra.hpp"
 
 namespace passman {
+    // Entries and fields belonging to a database live in its arena.
+    static PDPPEntry *bareEntry(PDPPDatabase *t_database) {
+        return t_database ? t_database->arena().make<PDPPEntry>() : new PDPPEntry();
+    }
+
+    static Field *makeField(PDPPDatabase *t_database, const QString &t_name, const VectorUnion &t_data, const QMetaType::Type t_type) {
+        return t_database ? t_database->makeField(t_name, t_data, t_type) : new Field(t_name, t_data, t_type);
+    }
+
     PDPPEntry::PDPPEntry(QList<Field *> t_fields, PDPPDatabase *t_database)
         : m_fields(t_fields)
         , m_database(t_database)
     {
         if (t_fields.empty()) {
-            for (const QString &s : {"Name", "Email", "URL", "Notes", "Password", "OTP"}) {
-                QMetaType::Type ftype = (s == "Notes" ? QMetaType::QByteArray : QMetaType::QString);
-                this->addField(new Field(s, "", ftype));
+            // The entry was created with new, so its fields are too; PDPPDatabase::makeEntry passes arena-made ones instead.
+            for (Field *f : defaultFields(nullptr)) {
+                this->addField(f);
             }
         } else {
+            for (Field *f : t_fields) {
+                f->setEntry(this);
+            }
+
             this->m_name = t_fields[0]->dataStr();
         }
     }
+
+    QList<Field *> PDPPEntry::defaultFields(PDPPDatabase *t_database) {
+        QList<Field *> fields;
+        for (const QString &s : {"Name", "Email", "URL", "Notes", "Password", "OTP"}) {
+            QMetaType::Type ftype = (s == "Notes" ? QMetaType::QByteArray : QMetaType::QString);
+            fields.emplaceBack(makeField(t_database, s, "", ftype));
+        }
+
+        return fields;
+    }
+
+    PDPPEntry *PDPPEntry::stub(const QString &t_name, PDPPDatabase *t_database) {
+        PDPPEntry *entry = bareEntry(t_database);
+
+        entry->m_database = t_database;
+        entry->m_name = t_name;
+        entry->m_loaded = false;
+
+        return entry;
+    }
+
+    PDPPEntry *PDPPEntry::snapshot(PDPPDatabase *t_database) {
+        if (!this->m_loaded) {
+            return stub(this->m_name, t_database);
+        }
+
+        PDPPEntry *copy;
+
+        if (!this->m_dirty && !this->m_record.empty()) {
+            // Saving only needs the record, so the fields don't need copying.
+            copy = bareEntry(t_database);
+            copy->m_database = t_database;
+            copy->m_dirty = false;
+            copy->m_record = this->m_record;
+            copy->m_sealed = this->m_sealed;
+        } else {
+            QList<Field *> fields;
+            for (Field *f : this->m_fields) {
+                fields.emplaceBack(makeField(t_database, f->name(), f->data(), f->type()));
+            }
+
+            copy = t_database ? t_database->makeEntry(fields) : new PDPPEntry(fields, t_database);
+        }
+
+        copy->m_name = this->m_name;
+        return copy;
+    }
+
+    void PDPPEntry::load() {
+        this->m_fields = this->m_database->loadFields(this);
+        this->m_loaded = true;
+        this->m_fieldIndexValid = false;
+
+        for (Field *f : this->m_fields) {
+            f->setEntry(this);
+        }
+
+        // Reading an entry doesn't change it; loadFields() seeds the cached record and sealed block where it has them.
+    }
+
+    Field *PDPPEntry::fieldNamed(const QString &t_name) {
+        ensureLoaded();
+
+        if (!this->m_fieldIndexValid) {
+            this->m_fieldIndex.clear();
+            this->m_fieldIndex.reserve(this->m_fields.size());
+
+            // The first field with a name wins, as it did with the old linear search.
+            for (Field *f : this->m_fields) {
+                if (!this->m_fieldIndex.contains(f->lowerName())) {
+                    this->m_fieldIndex.insert(f->lowerName(), f);
+                }
+            }
+
+            this->m_fieldIndexValid = true;
+        }
+
+        // Folding a name that's already folded hands back the same string, without allocating.
+        return this->m_fieldIndex.value(t_name.toCaseFolded(), Field::notFound());
+    }
+
+    void PDPPEntry::addField(Field *t_field) {
+        ensureLoaded();
+        if (t_field->isNull()) {
+            return;
+        }
+
+        this->m_fields.emplaceBack(t_field);
+        this->m_fieldIndexValid = false;
+        t_field->setEntry(this);
+        fieldChanged(t_field);
+    }
+
+    bool PDPPEntry::removeField(Field *t_field) {
+        ensureLoaded();
+        if (!this->m_fields.removeOne(t_field)) {
+            return false;
+        }
+
+        this->m_fieldIndexValid = false;
+        t_field->setEntry(nullptr);
+        fieldChanged(t_field);
+        return true;
+    }
+
+    QList<Field *> &PDPPEntry::setFields(QList<Field *> &t_fields) {
+        ensureLoaded();
+        for (Field *f : this->m_fields) {
+            f->setEntry(nullptr);
+        }
+
+        this->m_fields = t_fields;
+        this->m_fieldIndexValid = false;
+
+        for (Field *f : this->m_fields) {
+            f->setEntry(this);
+        }
+
+        fieldChanged(nullptr);
+        return t_fields;
+    }
+
+    void PDPPEntry::fieldChanged(Field *t_field) {
+        markDirty();
+
+        if (this->m_database) {
+            this->m_database->entryChanged(this, t_field);
+        }
+    }
+
+    QString &PDPPEntry::setName(QString &t_name) {
+        ensureLoaded();
+        markDirty();
+
+        const QString oldName = this->m_name;
+        this->m_name = t_name;
+
+        if (this->m_database) {
+            this->m_database->renameEntry(this, oldName);
+        }
+
+        return t_name;
+    }
+
+    void PDPPEntry::serialize(VectorUnion &t_out) {
+        const VectorUnion &rec = record();
+        t_out.insert(t_out.end(), rec.begin(), rec.end());
+    }
+
+    const VectorUnion &PDPPEntry::record() {
+        ensureLoaded();
+
+        if (this->m_dirty || this->m_record.empty()) {
+            this->m_record.clear();
+            appendInt(this->m_record, static_cast<uint32_t>(this->m_fields.size()));
+
+            for (Field *f : this->m_fields) {
+                f->serialize(this->m_record);
+            }
+
+            this->m_dirty = false;
+        }
+
+        return this->m_record;
+    }
+
+    void PDPPEntry::setCachedRecord(VectorUnion t_record, VectorUnion t_sealed) {
+        this->m_record = std::move(t_record);
+        this->m_sealed = std::move(t_sealed);
+        this->m_dirty = false;
+    }
+
+    void PDPPEntry::markDirty() {
+        this->m_dirty = true;
+        this->m_record = {};
+        this->m_sealed = {};
+    }
+
+    PDPPEntry *PDPPEntry::deserialize(const VectorUnion &t_in, size_t &t_pos, PDPPDatabase *t_database) {
+        const size_t start = t_pos;
+        QList<Field *> fields = deserializeFields(t_in, t_pos, t_database);
+
+        PDPPEntry *entry = t_database ? t_database->makeEntry(fields) : new PDPPEntry(fields, t_database);
+
+        // The bytes just read are the entry's record, so an unchanged entry is saved without serializing it again.
+        VectorUnion record;
+        record.assign(t_in.begin() + static_cast<std::ptrdiff_t>(start), t_in.begin() + static_cast<std::ptrdiff_t>(t_pos));
+        entry->setCachedRecord(std::move(record));
+
+        return entry;
+    }
+
+    QList<Field *> PDPPEntry::deserializeFields(const VectorUnion &t_in, size_t &t_pos, PDPPDatabase *t_database) {
+        const uint32_t fieldCount = readInt<uint32_t>(t_in, t_pos);
+        if (fieldCount == 0) {
+            throw std::runtime_error("Entry record has no fields.");
+        }
+
+        QList<Field *> fields;
+        // Every field record takes at least 12 bytes, which bounds the reservation for corrupt counts.
+        fields.reserve(static_cast<qsizetype>(std::min<size_t>(fieldCount, (t_in.size() - t_pos) / 12)));
+
+        for (uint32_t i = 0; i < fieldCount; ++i) {
+            fields.emplaceBack(Field::deserialize(t_in, t_pos, t_database));
+        }
+
+        return fields;
+    }
 }
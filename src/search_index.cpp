@@ -0,0 +1,212 @@
+#include <algorithm>
+
+#include "search_index.hpp"
+#include "pdpp_entry.hpp"
+
+namespace passman {
+    // Decoded field data isn't in secure memory, so overwrite it before it's freed.
+    static void wipe(QString &t_text) {
+        if (!t_text.isDetached()) {
+            return;
+        }
+
+        t_text.fill(QChar(0));
+    }
+
+    static QString foldedData(Field *t_field) {
+        return t_field->dataStr().toCaseFolded();
+    }
+
+    SearchIndex::SecureList<SearchIndex::Trigram> SearchIndex::trigrams(const QString &t_text) {
+        SecureList<Trigram> keys;
+        if (t_text.size() < 3) {
+            return keys;
+        }
+
+        keys.reserve(static_cast<size_t>(t_text.size() - 2));
+        for (qsizetype i = 0; i + 2 < t_text.size(); ++i) {
+            keys.emplace_back(static_cast<Trigram>(t_text.at(i).unicode()) << 32
+                              | static_cast<Trigram>(t_text.at(i + 1).unicode()) << 16
+                              | static_cast<Trigram>(t_text.at(i + 2).unicode()));
+        }
+
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        return keys;
+    }
+
+    bool SearchIndex::indexable(Field *t_field) {
+        return !t_field->isPass() && t_field->nameAtom()->folded->id != AtomTable::Otp;
+    }
+
+    // While building, postings are appended and sorted once at the end rather than kept sorted.
+    void SearchIndex::addField(PDPPEntry *t_entry, Field *t_field, const bool t_sorted) {
+        m_entryFields[t_entry].emplace_back(t_field);
+        if (!indexable(t_field)) {
+            return;
+        }
+
+        QString text = foldedData(t_field);
+        SecureList<Trigram> &keys = m_fieldTrigrams[t_field];
+        keys = trigrams(text);
+        wipe(text);
+
+        for (const Trigram key : keys) {
+            SecureList<Field *> &posting = m_postings[key];
+            if (t_sorted) {
+                posting.insert(std::lower_bound(posting.begin(), posting.end(), t_field), t_field);
+            } else {
+                posting.emplace_back(t_field);
+            }
+        }
+    }
+
+    void SearchIndex::removeField(PDPPEntry *t_entry, Field *t_field) {
+        auto entry = m_entryFields.find(t_entry);
+        if (entry != m_entryFields.end()) {
+            SecureList<Field *> &fields = entry->second;
+            fields.erase(std::remove(fields.begin(), fields.end(), t_field), fields.end());
+        }
+
+        auto it = m_fieldTrigrams.find(t_field);
+        if (it == m_fieldTrigrams.end()) {
+            return;
+        }
+
+        for (const Trigram key : it->second) {
+            auto posting = m_postings.find(key);
+            SecureList<Field *> &fields = posting->second;
+
+            auto pos = std::lower_bound(fields.begin(), fields.end(), t_field);
+            if (pos != fields.end() && *pos == t_field) {
+                fields.erase(pos);
+            }
+
+            if (fields.empty()) {
+                m_postings.erase(posting);
+            }
+        }
+
+        m_fieldTrigrams.erase(it);
+    }
+
+    void SearchIndex::build(const QList<PDPPEntry *> &t_entries) {
+        clear();
+        m_entryFields.reserve(static_cast<size_t>(t_entries.size()));
+
+        for (PDPPEntry *e : t_entries) {
+            m_entryFields[e];
+            for (Field *f : e->fields()) {
+                addField(e, f, false);
+            }
+        }
+
+        for (auto &posting : m_postings) {
+            std::sort(posting.second.begin(), posting.second.end());
+        }
+    }
+
+    void SearchIndex::clear() {
+        // Freeing the containers wipes them; swapping with empty ones frees the buckets too.
+        SecureMap<Trigram, SecureList<Field *>>().swap(m_postings);
+        SecureMap<Field *, SecureList<Trigram>>().swap(m_fieldTrigrams);
+        SecureMap<PDPPEntry *, SecureList<Field *>>().swap(m_entryFields);
+    }
+
+    bool SearchIndex::contains(PDPPEntry *t_entry) const {
+        return m_entryFields.find(t_entry) != m_entryFields.end();
+    }
+
+    void SearchIndex::addEntry(PDPPEntry *t_entry) {
+        m_entryFields[t_entry];
+        for (Field *f : t_entry->fields()) {
+            addField(t_entry, f, true);
+        }
+    }
+
+    void SearchIndex::removeEntry(PDPPEntry *t_entry) {
+        auto it = m_entryFields.find(t_entry);
+        if (it == m_entryFields.end()) {
+            return;
+        }
+
+        // Copied, since removeField() edits the entry's list.
+        const SecureList<Field *> fields = it->second;
+        for (Field *f : fields) {
+            removeField(t_entry, f);
+        }
+
+        m_entryFields.erase(t_entry);
+    }
+
+    void SearchIndex::updateField(PDPPEntry *t_entry, Field *t_field) {
+        if (!t_field) {
+            removeEntry(t_entry);
+            addEntry(t_entry);
+            return;
+        }
+
+        removeField(t_entry, t_field);
+
+        // A field removed from the entry is no longer its own.
+        if (t_field->entry() == t_entry) {
+            addField(t_entry, t_field, true);
+        }
+    }
+
+    QList<SearchHit> SearchIndex::search(const QString &t_query) const {
+        QString query = t_query.toCaseFolded();
+        QList<SearchHit> hits;
+        if (query.isEmpty()) {
+            return hits;
+        }
+
+        const SecureList<Trigram> keys = trigrams(query);
+        SecureList<Field *> candidates;
+
+        if (keys.empty()) {
+            candidates.reserve(m_fieldTrigrams.size());
+            for (const auto &field : m_fieldTrigrams) {
+                candidates.emplace_back(field.first);
+            }
+        } else {
+            std::vector<const SecureList<Field *> *> lists;
+            lists.reserve(keys.size());
+
+            for (const Trigram key : keys) {
+                auto posting = m_postings.find(key);
+                if (posting == m_postings.end()) {
+                    wipe(query);
+                    return hits;
+                }
+
+                lists.emplace_back(&posting->second);
+            }
+
+            // Starting from the rarest trigram keeps the intersections small.
+            std::sort(lists.begin(), lists.end(), [](const SecureList<Field *> *a, const SecureList<Field *> *b) {
+                return a->size() < b->size();
+            });
+
+            candidates = *lists.front();
+            for (size_t i = 1; i < lists.size() && !candidates.empty(); ++i) {
+                SecureList<Field *> both;
+                std::set_intersection(candidates.begin(), candidates.end(), lists[i]->begin(), lists[i]->end(), std::back_inserter(both));
+                candidates.swap(both);
+            }
+        }
+
+        // Sharing every trigram doesn't make the query a substring, so check each candidate.
+        for (Field *f : candidates) {
+            QString text = foldedData(f);
+            if (text.contains(query)) {
+                hits.emplaceBack(SearchHit{f->entry(), f});
+            }
+
+            wipe(text);
+        }
+
+        wipe(query);
+        return hits;
+    }
+}
@@ -0,0 +1,153 @@
+#include "stream_cipher.hpp"
+#include "constants.hpp"
+
+namespace passman {
+    // The prefix leaves room for a 4-byte chunk index and a 1-byte last chunk flag.
+    static secvec chunkNonce(const secvec &t_prefix, const uint32_t t_counter, const bool t_last) {
+        secvec nonce(t_prefix);
+
+        for (const int shift : {24, 16, 8, 0}) {
+            nonce.push_back(static_cast<uint8_t>(t_counter >> shift));
+        }
+        nonce.push_back(t_last ? 1 : 0);
+
+        return nonce;
+    }
+
+    StreamEncryptor::StreamEncryptor(Botan::Cipher_Mode &t_enc, Botan::Cipher_Mode *t_keyEnc, Botan::RandomNumberGenerator &t_rng, Sink t_sink)
+        : m_enc(t_enc)
+        , m_keyEnc(t_keyEnc)
+        , m_sink(t_sink)
+    {
+        m_prefix = t_rng.random_vec(m_enc.default_nonce_length() - 5);
+        m_sink(m_prefix);
+    }
+
+    void StreamEncryptor::update(const uint8_t *t_data, const size_t t_len) {
+        m_buffer.insert(m_buffer.end(), t_data, t_data + t_len);
+
+        // Always hold back at least one byte, so the last chunk is never empty unless the whole stream is.
+        size_t pos = 0;
+        while (m_buffer.size() - pos > Constants::streamChunkSize) {
+            secvec chunk(m_buffer.begin() + static_cast<std::ptrdiff_t>(pos), m_buffer.begin() + static_cast<std::ptrdiff_t>(pos + Constants::streamChunkSize));
+            sealChunk(chunk, false);
+            pos += Constants::streamChunkSize;
+        }
+
+        m_buffer.erase(m_buffer.begin(), m_buffer.begin() + static_cast<std::ptrdiff_t>(pos));
+    }
+
+    void StreamEncryptor::finish() {
+        sealChunk(m_buffer, true);
+        m_buffer.clear();
+    }
+
+    void StreamEncryptor::sealChunk(secvec &t_chunk, const bool t_last) {
+        const secvec nonce = chunkNonce(m_prefix, m_counter++, t_last);
+
+        for (Botan::Cipher_Mode *mode : {&m_enc, m_keyEnc}) {
+            if (mode) {
+                mode->start(nonce);
+                mode->finish(t_chunk);
+            }
+        }
+
+        secvec frame;
+        frame.reserve(5 + t_chunk.size());
+        appendInt(frame, static_cast<uint32_t>(t_chunk.size()));
+        frame.push_back(t_last ? 1 : 0);
+        frame.insert(frame.end(), t_chunk.begin(), t_chunk.end());
+
+        m_sink(frame);
+    }
+
+    StreamDecryptor::StreamDecryptor(Botan::Cipher_Mode &t_dec, Botan::Cipher_Mode *t_keyDec, Sink t_sink)
+        : m_dec(t_dec)
+        , m_keyDec(t_keyDec)
+        , m_sink(t_sink)
+        , m_prefixLen(t_dec.default_nonce_length() - 5)
+    {}
+
+    int StreamDecryptor::update(const uint8_t *t_data, const size_t t_len) {
+        m_buffer.insert(m_buffer.end(), t_data, t_data + t_len);
+        size_t pos = 0;
+
+        if (m_prefix.empty()) {
+            if (m_buffer.size() < m_prefixLen) {
+                return 1;
+            }
+
+            m_prefix.assign(m_buffer.begin(), m_buffer.begin() + static_cast<std::ptrdiff_t>(m_prefixLen));
+            pos = m_prefixLen;
+        }
+
+        while (m_buffer.size() - pos >= 5) {
+            size_t header = pos;
+            const uint32_t len = readInt<uint32_t>(m_buffer, header);
+            const bool last = m_buffer[header++] != 0;
+
+            if (m_buffer.size() - header < len) {
+                break;
+            }
+
+            if (m_finished) {
+                throw std::runtime_error("Trailing data after the last chunk.");
+            }
+
+            secvec chunk(m_buffer.begin() + static_cast<std::ptrdiff_t>(header), m_buffer.begin() + static_cast<std::ptrdiff_t>(header + len));
+            const secvec nonce = chunkNonce(m_prefix, m_counter, last);
+
+            for (Botan::Cipher_Mode *mode : {m_keyDec, &m_dec}) {
+                if (!mode) {
+                    continue;
+                }
+
+                try {
+                    mode->start(nonce);
+                    mode->finish(chunk);
+                } catch (std::exception &e) {
+                    std::cerr << e.what() << std::endl;
+                    return mode == m_keyDec ? 3 : 0;
+                }
+            }
+
+            ++m_counter;
+            m_finished = last;
+            pos = header + len;
+
+            m_sink(chunk);
+        }
+
+        m_buffer.erase(m_buffer.begin(), m_buffer.begin() + static_cast<std::ptrdiff_t>(pos));
+        return 1;
+    }
+
+    void StreamDecryptor::finish() {
+        if (!m_finished) {
+            throw std::runtime_error("Encrypted stream is truncated.");
+        }
+
+        if (!m_buffer.empty()) {
+            throw std::runtime_error("Trailing data after the last chunk.");
+        }
+    }
+
+    uint32_t StreamDecryptor::chunks() {
+        return m_counter;
+    }
+
+    bool StreamDecryptor::finished() {
+        return m_finished;
+    }
+
+    const secvec &StreamDecryptor::prefix() {
+        return m_prefix;
+    }
+
+    void StreamDecryptor::resume(const secvec &t_prefix, const uint32_t t_chunks, const bool t_finished) {
+        m_prefix = t_prefix;
+        m_counter = t_chunks;
+        m_finished = t_finished;
+        m_buffer.clear();
+    }
+}
@@ -1,32 +1,39 @@
 #include <botan/hex.h>
 #include <botan/base32.h>
 
+#include <cstring>
+
 #include "vector_union.hpp"
 
 namespace passman {
     VectorUnion::VectorUnion(const QString &data) {
-        *this = data.toStdString();
+        const QByteArray utf8 = data.toUtf8();
+        this->assign(utf8.begin(), utf8.end());
     }
 
-    VectorUnion::VectorUnion(const std::string &data) {
-        *this = secvec(data.begin(), data.end());
-    }
+    VectorUnion::VectorUnion(const std::string &data)
+        : secvec(data.begin(), data.end())
+    {}
 
-    VectorUnion::VectorUnion(const char *data, const int length) {
-        if (length == 0) {
-            *this = QString(data);
-        } else {
-            *this = std::string(data, length);
-        }
-    }
+    VectorUnion::VectorUnion(const char *data, const int length)
+        : secvec(data, data + (length != 0 ? static_cast<size_t>(length) : data ? std::strlen(data) : 0))
+    {}
 
-    VectorUnion::VectorUnion(const secvec &data) {
-        this->assign(data.begin(), data.end());
-    }
+    VectorUnion::VectorUnion(const secvec &data)
+        : secvec(data)
+    {}
 
-    VectorUnion::VectorUnion(const std::vector<uint8_t> &data) {
-        this->operator=(secvec(data.begin(), data.end()));
-    }
+    VectorUnion::VectorUnion(secvec &&data)
+        : secvec(std::move(data))
+    {}
+
+    VectorUnion::VectorUnion(const ByteView &data)
+        : secvec(data.begin(), data.end())
+    {}
+
+    VectorUnion::VectorUnion(const std::vector<uint8_t> &data)
+        : secvec(data.begin(), data.end())
+    {}
 
     VectorUnion::VectorUnion(const QVariant &data) {
         this->operator=(data.toString());
@@ -40,16 +47,16 @@ namespace passman {
         this->operator=(QVariant(data));
     }
 
-    VectorUnion::VectorUnion(const QByteArray &data) {
-        *this = VectorUnion(data.constData(), static_cast<int>(data.size()));
-    }
+    VectorUnion::VectorUnion(const QByteArray &data)
+        : secvec(data.begin(), data.end())
+    {}
 
     const char *VectorUnion::asConstChar() const {
         return reinterpret_cast<const char *>(this->data());
     }
 
     QString VectorUnion::asQStr() const {
-        return QString::fromStdString(asStdStr());
+        return QString::fromUtf8(this->asConstChar(), static_cast<qsizetype>(this->size()));
     }
 
     std::string VectorUnion::asStdStr() const {
@@ -61,7 +68,7 @@ namespace passman {
     }
 
     QByteArray VectorUnion::asQByteArray() const {
-        return QByteArray(this->asConstChar());
+        return QByteArray(this->asConstChar(), static_cast<qsizetype>(this->size()));
     }
 
     VectorUnion VectorUnion::hex_encode() const {
@@ -69,7 +76,7 @@ namespace passman {
     }
 
     VectorUnion VectorUnion::hex_decode() const {
-        return Botan::hex_decode(this->asStdStr());
+        return Botan::hex_decode_locked(this->asConstChar(), this->size());
     }
 
     VectorUnion VectorUnion::base32_encode() const {
@@ -77,7 +84,7 @@ namespace passman {
     }
 
     VectorUnion VectorUnion::base32_decode() const {
-        return Botan::base32_decode(this->asStdStr());
+        return Botan::base32_decode(this->asConstChar(), this->size());
     }
 
     VectorUnion::operator bool() const {
@@ -88,10 +95,14 @@ namespace passman {
         return this->asQVariant().toDouble();
     }
 
-    VectorUnion &VectorUnion::operator+=(QString s) {
-        QString t_str = this->asQStr();
-        t_str.append(s);
-        *this = t_str;
+    VectorUnion &VectorUnion::operator+=(const QString &s) {
+        const QByteArray utf8 = s.toUtf8();
+        this->insert(this->end(), utf8.begin(), utf8.end());
+        return *this;
+    }
+
+    VectorUnion &VectorUnion::operator+=(const ByteView &s) {
+        this->insert(this->end(), s.begin(), s.end());
         return *this;
     }
 }
@@ -0,0 +1,476 @@
+#include <botan/auto_rng.h>
+#include <QFile>
+#include <QTemporaryDir>
+#include <QtEndian>
+#include <QtTest>
+
+#include "compression.hpp"
+#include "pdpp_database.hpp"
+#include "pdpp_entry.hpp"
+
+/*
+ * Round trips and tamper checks for the version 8 file format: the header, every data layout and compression option,
+ * STREAM chunk framing and the entry block table.
+ */
+
+using namespace passman;
+
+namespace {
+    const QString password = "correct horse battery staple";
+    const QString newPassword = "tr0ub4dor&3";
+    constexpr int entryCount = 8;
+
+    // Entry names and values all have the same length, so in an EntryBlocks vault every block does too.
+    PDPPEntry *makeEntry(PDPPDatabase *t_database, const int t_index, const qsizetype t_notesLen) {
+        const QString id = QString::number(t_index);
+
+        QList<Field *> fields = {
+            t_database->makeField("Name", "entry-" + id, QMetaType::QString),
+            t_database->makeField("Email", "user" + id + "@example.com", QMetaType::QString),
+            t_database->makeField("Notes", QString(t_notesLen, QChar('a' + t_index)), QMetaType::QByteArray),
+            t_database->makeField("Password", "pw-" + id + "-Xk2!q9", QMetaType::QString)
+        };
+
+        return t_database->makeEntry(fields);
+    }
+
+    // Cheap Argon2id settings, so the memory cost and parallelism are written to the header.
+    void createVault(PDPPDatabase &t_out, const QString &t_path, const uint8_t t_layout, const uint8_t t_compress, const qsizetype t_notesLen = 16) {
+        t_out.path = t_path;
+        t_out.name = "Tests";
+        t_out.desc = "Format round trips";
+        t_out.hash = 0;
+        t_out.hashIters = 1;
+        t_out.memoryUsage = 8;
+        t_out.parallelism = 2;
+        t_out.layout = t_layout;
+        t_out.compress = t_compress;
+        t_out.compressionLevel = t_compress == 0 ? 0 : 3;
+
+        // The IV doubles as the KDF's seed, so it has to be in place before deriving the key.
+        Botan::AutoSeeded_RNG rng;
+        t_out.ivLen = KDF::nonceLength(t_out.encryption);
+        t_out.iv = rng.random_vec(t_out.ivLen);
+        t_out.passw = t_out.makeKdf()->transform(password);
+
+        for (const int i : range(0, entryCount)) {
+            t_out.addEntry(makeEntry(&t_out, i, t_notesLen));
+        }
+
+        t_out.save();
+    }
+
+    int openVault(PDPPDatabase &t_in, const QString &t_path, const QString &t_password = password) {
+        t_in.path = t_path;
+        return t_in.open(t_password, "");
+    }
+
+    void checkEntries(PDPPDatabase &t_in, const qsizetype t_notesLen = 16) {
+        QCOMPARE(t_in.entryLength(), static_cast<qsizetype>(entryCount));
+
+        for (const int i : range(0, entryCount)) {
+            const QString id = QString::number(i);
+            PDPPEntry *entry = t_in.entryNamed("entry-" + id);
+
+            QVERIFY(entry);
+            QCOMPARE(entry->fieldNamed("Email")->dataStr(), "user" + id + "@example.com");
+            QCOMPARE(entry->fieldNamed("Notes")->dataStr(), QString(t_notesLen, QChar('a' + i)));
+            QCOMPARE(entry->fieldNamed("Password")->dataStr(), "pw-" + id + "-Xk2!q9");
+        }
+    }
+
+    QByteArray readFile(const QString &t_path) {
+        QFile f(t_path);
+        if (!f.open(QIODevice::ReadOnly)) {
+            return {};
+        }
+
+        return f.readAll();
+    }
+
+    void writeFile(const QString &t_path, const QByteArray &t_data) {
+        QFile f(t_path);
+        QVERIFY(f.open(QIODevice::WriteOnly | QIODevice::Truncate));
+        QCOMPARE(f.write(t_data), t_data.size());
+    }
+
+    // Where the encrypted data starts in a file written by createVault: 19 header bytes with Argon2id, the IV, then the name and description lines.
+    qsizetype dataOffset(PDPPDatabase &t_db) {
+        return 19 + static_cast<qsizetype>(t_db.ivLen) + t_db.name.asQStr().toUtf8().size() + 1 + t_db.desc.asQStr().toUtf8().size() + 1;
+    }
+
+    // Splits the data of a Stream vault into its nonce prefix and frames (length, last chunk flag and ciphertext).
+    QList<QByteArray> streamFrames(const QByteArray &t_data, const qsizetype t_prefixLen) {
+        QList<QByteArray> frames{t_data.left(t_prefixLen)};
+
+        for (qsizetype pos = t_prefixLen; pos < t_data.size();) {
+            const qsizetype len = 5 + static_cast<qsizetype>(qFromLittleEndian<quint32>(t_data.constData() + pos));
+            frames.emplaceBack(t_data.mid(pos, len));
+            pos += len;
+        }
+
+        return frames;
+    }
+
+    // Where the blocks of an EntryBlocks vault start, after the table's length and the sealed table.
+    qsizetype blocksOffset(const QByteArray &t_file, const qsizetype t_dataOffset) {
+        return t_dataOffset + 4 + static_cast<qsizetype>(qFromLittleEndian<quint32>(t_file.constData() + t_dataOffset));
+    }
+
+    bool loadFails(PDPPEntry *t_entry) {
+        try {
+            t_entry->ensureLoaded();
+        } catch (const std::runtime_error &) {
+            return true;
+        }
+
+        return false;
+    }
+
+    void addLayouts() {
+        QTest::addColumn<uchar>("layout");
+        QTest::addColumn<uchar>("compress");
+
+        const QStringList layouts = {"SinglePayload", "EntryBlocks", "Stream"};
+        const int compressions = static_cast<int>(Constants::compressionMatch.size());
+
+        for (const int l : range(0, static_cast<int>(layouts.size()))) {
+            for (const int c : range(0, compressions)) {
+                const QString tag = layouts.at(l) + '/' + QString::fromStdString(Constants::compressionMatch.at(c));
+                QTest::newRow(tag.toUtf8().constData()) << static_cast<uchar>(l) << static_cast<uchar>(c);
+            }
+        }
+    }
+}
+
+class FormatsTest : public QObject
+{
+    Q_OBJECT
+
+    QTemporaryDir m_dir;
+
+    QString vaultPath() {
+        return m_dir.filePath("vault.pdpp");
+    }
+
+private slots:
+    void initTestCase() {
+        QVERIFY(m_dir.isValid());
+
+        db.setDatabaseName(":memory:");
+        QVERIFY(db.open());
+    }
+
+    void header_data() {
+        addLayouts();
+    }
+
+    void header() {
+        QFETCH(uchar, layout);
+        QFETCH(uchar, compress);
+
+        if (!compressionAvailable(compress)) {
+            QSKIP("Compression option not available in this build.");
+        }
+
+        PDPPDatabase out;
+        createVault(out, vaultPath(), layout, compress);
+
+        const QByteArray file = readFile(vaultPath());
+        QVERIFY(file.size() > dataOffset(out));
+        QCOMPARE(file.left(4), QByteArray("PD++"));
+        QCOMPARE(static_cast<uchar>(file.at(4)), static_cast<uchar>(Constants::maxVersion));
+        QCOMPARE(static_cast<uchar>(file.at(6)), static_cast<uchar>(0));
+        QCOMPARE(static_cast<uchar>(file.at(7)), static_cast<uchar>(1));
+
+        // The memory cost is stored exactly, in KiB and big-endian, followed by the parallelism.
+        QCOMPARE(qFromBigEndian<quint32>(file.constData() + 10), 8000u);
+        QCOMPARE(static_cast<uchar>(file.at(14)), static_cast<uchar>(2));
+        QCOMPARE(static_cast<uchar>(file.at(16)), compress);
+        QCOMPARE(static_cast<uchar>(file.at(17)), out.compressionLevel);
+        QCOMPARE(static_cast<uchar>(file.at(18)), layout);
+
+        PDPPDatabase in;
+        in.path = vaultPath();
+        QCOMPARE(in.parse(), 1);
+        QCOMPARE(in.version, static_cast<uint8_t>(Constants::maxVersion));
+        QCOMPARE(in.memoryUsage, 8u);
+        QCOMPARE(in.parallelism, static_cast<uint8_t>(2));
+        QCOMPARE(in.compress, compress);
+        QCOMPARE(in.compressionLevel, out.compressionLevel);
+        QCOMPARE(in.layout, layout);
+        QVERIFY(in.iv == out.iv);
+        QCOMPARE(in.name.asQStr(), out.name.asQStr());
+        QCOMPARE(in.desc.asQStr(), out.desc.asQStr());
+    }
+
+    void roundTrip_data() {
+        addLayouts();
+    }
+
+    void roundTrip() {
+        QFETCH(uchar, layout);
+        QFETCH(uchar, compress);
+
+        if (!compressionAvailable(compress)) {
+            QSKIP("Compression option not available in this build.");
+        }
+
+        // Large enough notes that a Stream vault spans several chunks.
+        const qsizetype notesLen = 24 * 1024;
+
+        {
+            PDPPDatabase out;
+            createVault(out, vaultPath(), layout, compress, notesLen);
+        }
+
+        PDPPDatabase in;
+        QCOMPARE(openVault(in, vaultPath()), 1);
+
+        if (layout == EntryBlocks) {
+            for (PDPPEntry *entry : in.entries()) {
+                QVERIFY(!entry->isLoaded());
+            }
+        }
+
+        checkEntries(in, notesLen);
+
+        // Saving again over the opened file, with one entry edited and the rest untouched.
+        in.entryNamed("entry-3")->fieldNamed("Email")->setData(QString("edited@example.com"));
+        in.save();
+
+        PDPPDatabase again;
+        QCOMPARE(openVault(again, vaultPath()), 1);
+        QCOMPARE(again.entryLength(), static_cast<qsizetype>(entryCount));
+        QCOMPARE(again.entryNamed("entry-3")->fieldNamed("Email")->dataStr(), QString("edited@example.com"));
+        QCOMPARE(again.entryNamed("entry-4")->fieldNamed("Email")->dataStr(), QString("user4@example.com"));
+    }
+
+    void wrongPassword_data() {
+        addLayouts();
+    }
+
+    void wrongPassword() {
+        QFETCH(uchar, layout);
+        QFETCH(uchar, compress);
+
+        if (!compressionAvailable(compress)) {
+            QSKIP("Compression option not available in this build.");
+        }
+
+        {
+            PDPPDatabase out;
+            createVault(out, vaultPath(), layout, compress);
+        }
+
+        PDPPDatabase in;
+        QCOMPARE(openVault(in, vaultPath(), newPassword), 0);
+    }
+
+    void compressors_data() {
+        QTest::addColumn<uchar>("compress");
+
+        // Every option but none.
+        for (const int c : range(1, static_cast<int>(Constants::compressionMatch.size()) - 1)) {
+            QTest::newRow(Constants::compressionMatch.at(c).c_str()) << static_cast<uchar>(c);
+        }
+    }
+
+    // Compressed data must survive being decompressed a piece at a time, as the Stream layout does.
+    void compressors() {
+        QFETCH(uchar, compress);
+
+        if (!compressionAvailable(compress)) {
+            QSKIP("Compression option not available in this build.");
+        }
+
+        secvec plain;
+        for (const int i : range(0, 200000)) {
+            plain.push_back(static_cast<uint8_t>((i % 251) ^ (i / 1000)));
+        }
+
+        secvec packed = plain;
+        std::unique_ptr<Botan::Compression_Algorithm> comp = makeCompressor(compress);
+        QVERIFY(comp);
+        comp->start(3);
+        comp->finish(packed);
+        QVERIFY(packed.size() < plain.size());
+
+        std::unique_ptr<Botan::Decompression_Algorithm> decomp = makeDecompressor(compress);
+        QVERIFY(decomp);
+        decomp->start();
+
+        secvec unpacked;
+        for (size_t pos = 0; pos < packed.size(); pos += 1000) {
+            secvec piece(packed.begin() + static_cast<std::ptrdiff_t>(pos), packed.begin() + static_cast<std::ptrdiff_t>(std::min(packed.size(), pos + 1000)));
+            decomp->update(piece);
+            unpacked.insert(unpacked.end(), piece.begin(), piece.end());
+        }
+
+        secvec tail;
+        decomp->finish(tail);
+        unpacked.insert(unpacked.end(), tail.begin(), tail.end());
+
+        QVERIFY(unpacked == plain);
+    }
+
+    void streamTamper_data() {
+        QTest::addColumn<QString>("tamper");
+
+        QTest::newRow("truncated last chunk") << QString("truncate");
+        QTest::newRow("reordered chunks") << QString("reorder");
+        QTest::newRow("dropped final flag") << QString("flag");
+        QTest::newRow("dropped last chunk") << QString("drop");
+    }
+
+    void streamTamper() {
+        QFETCH(QString, tamper);
+
+        qsizetype offset;
+        size_t prefixLen;
+        {
+            PDPPDatabase out;
+            createVault(out, vaultPath(), Stream, 0, 24 * 1024);
+            offset = dataOffset(out);
+            prefixLen = KDF::nonceLength(out.encryption) - 5;
+        }
+
+        const QByteArray file = readFile(vaultPath());
+        QList<QByteArray> frames = streamFrames(file.mid(offset), static_cast<qsizetype>(prefixLen));
+
+        // The prefix and at least three chunks, so the first chunk can stay intact while later ones are tampered with.
+        QVERIFY(frames.size() >= 4);
+        QCOMPARE(static_cast<uchar>(frames.last().at(4)), static_cast<uchar>(1));
+
+        if (tamper == "truncate") {
+            frames.last().chop(16);
+        } else if (tamper == "reorder") {
+            frames.swapItemsAt(2, 3);
+        } else if (tamper == "flag") {
+            frames.last()[4] = 0;
+        } else {
+            frames.removeLast();
+        }
+
+        writeFile(vaultPath(), file.left(offset) + frames.join());
+
+        PDPPDatabase in;
+        QCOMPARE(openVault(in, vaultPath()), 0);
+    }
+
+    void swappedBlocks() {
+        qsizetype offset;
+        {
+            PDPPDatabase out;
+            createVault(out, vaultPath(), EntryBlocks, 0);
+            offset = dataOffset(out);
+        }
+
+        QByteArray file = readFile(vaultPath());
+        const qsizetype blocks = blocksOffset(file, offset);
+        const qsizetype blockLen = (file.size() - blocks) / entryCount;
+        QCOMPARE(blockLen * entryCount, file.size() - blocks);
+
+        const QByteArray first = file.mid(blocks, blockLen);
+        file.replace(blocks, blockLen, file.mid(blocks + blockLen, blockLen));
+        file.replace(blocks + blockLen, blockLen, first);
+        writeFile(vaultPath(), file);
+
+        // The table is intact, so the vault opens; only the swapped entries fail to load.
+        PDPPDatabase in;
+        QCOMPARE(openVault(in, vaultPath()), 1);
+        QVERIFY(loadFails(in.entryNamed("entry-0")));
+        QVERIFY(loadFails(in.entryNamed("entry-1")));
+        QVERIFY(!loadFails(in.entryNamed("entry-2")));
+    }
+
+    // An older block for the same entry, sealed under the same key, must not be accepted in place of the current one.
+    void rolledBackBlock() {
+        const QString path = vaultPath();
+        qsizetype offset;
+        QByteArray before;
+        {
+            PDPPDatabase out;
+            createVault(out, path, EntryBlocks, 0);
+            offset = dataOffset(out);
+            before = readFile(path);
+
+            // Same length, so every block stays where it was.
+            out.entryNamed("entry-0")->fieldNamed("Password")->setData(QString("pw-0-Zq7!w4"));
+            out.save();
+        }
+
+        QByteArray after = readFile(path);
+        QCOMPARE(after.size(), before.size());
+
+        const qsizetype blocks = blocksOffset(after, offset);
+        QCOMPARE(blocksOffset(before, offset), blocks);
+
+        const qsizetype blockLen = (after.size() - blocks) / entryCount;
+        QVERIFY(before.mid(blocks, blockLen) != after.mid(blocks, blockLen));
+        QCOMPARE(before.mid(blocks + blockLen), after.mid(blocks + blockLen));
+
+        after.replace(blocks, blockLen, before.mid(blocks, blockLen));
+        writeFile(path, after);
+
+        PDPPDatabase in;
+        QCOMPARE(openVault(in, path), 1);
+        QVERIFY(loadFails(in.entryNamed("entry-0")));
+        QVERIFY(!loadFails(in.entryNamed("entry-1")));
+    }
+
+    void rekeyUnopenedBlocks_data() {
+        QTest::addColumn<bool>("async");
+        QTest::addColumn<bool>("changeCipher");
+
+        QTest::newRow("password") << false << false;
+        QTest::newRow("password and cipher") << false << true;
+        QTest::newRow("password, async") << true << false;
+        QTest::newRow("password and cipher, async") << true << true;
+    }
+
+    // Changing the keys of an EntryBlocks vault whose entries were never opened must still save every entry.
+    void rekeyUnopenedBlocks() {
+        QFETCH(bool, async);
+        QFETCH(bool, changeCipher);
+
+        {
+            PDPPDatabase out;
+            createVault(out, vaultPath(), EntryBlocks, 0);
+        }
+
+        {
+            PDPPDatabase in;
+            QCOMPARE(openVault(in, vaultPath()), 1);
+
+            for (PDPPEntry *entry : in.entries()) {
+                QVERIFY(!entry->isLoaded());
+            }
+
+            if (changeCipher) {
+                in.encryption = 4;
+            }
+
+            Botan::AutoSeeded_RNG rng;
+            in.ivLen = KDF::nonceLength(in.encryption);
+            in.iv = rng.random_vec(in.ivLen);
+            in.passw = in.makeKdf()->transform(newPassword);
+
+            if (async) {
+                QVERIFY(in.saveAsync().result());
+            } else {
+                in.save();
+            }
+        }
+
+        PDPPDatabase old;
+        QCOMPARE(openVault(old, vaultPath()), 0);
+
+        PDPPDatabase again;
+        QCOMPARE(openVault(again, vaultPath(), newPassword), 1);
+        checkEntries(again);
+    }
+};
+
+QTEST_GUILESS_MAIN(FormatsTest)
+#include "tst_formats.moc"